@@ -0,0 +1,256 @@
+/***************************** PARSER BENCHMARK ******************************/
+
+#define JDM_TELNET_IMPLEMENTATION
+#include "jdm_telnet.h"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/* USAGE:
+ *  bench_telnet [seconds]
+ *
+ *  runs every corpus through the parser cut into 1 byte, 7 byte, MTU sized
+ *  and unfragmented buffers. each combination is repeated for at least
+ *  the given number of seconds (default 0.2).
+ *
+ *  cycles/byte comes from the time stamp counter, which ticks at a fixed
+ *  rate that is close to, but not always the same as, the core clock.
+ */
+
+#define CORPUS_SIZE (4<<20)
+
+struct corpus {
+    const char *name;
+    char *data;
+    size_t len;
+};
+
+struct decoder {
+    const char *name;
+    /* decode one buffer, return the number of events */
+    size_t (*run)(struct telnet_info *ts, size_t len, char *buf);
+};
+
+static unsigned long long checksum; /* keeps results live */
+
+/* a small deterministic generator, so runs are comparable */
+static unsigned long rng_state=1;
+static unsigned rng(void) {
+    rng_state=rng_state*1103515245+12345;
+    return (unsigned)(rng_state>>16)&0x7fff;
+}
+
+static size_t append(char *dst, size_t pos, size_t len, const char *src) {
+    memcpy(dst+pos, src, len);
+    return pos+len;
+}
+
+static void make_ascii(struct corpus *c) {
+    size_t i;
+
+    c->name="ascii";
+    c->data=malloc(CORPUS_SIZE);
+    for(i=0;i<CORPUS_SIZE;i++) {
+        c->data[i]=(i%72==71) ? '\n' : (char)(' '+rng()%95);
+    }
+    c->len=CORPUS_SIZE;
+}
+
+/* 8-bit text where about one byte in 16 is an escaped 0xFF */
+static void make_iac_dense(struct corpus *c) {
+    size_t n=0;
+
+    c->name="8bit-iac";
+    c->data=malloc(CORPUS_SIZE+1);
+    while(n<CORPUS_SIZE) {
+        if(rng()%16==0) {
+            c->data[n++]=(char)IAC;
+            c->data[n++]=(char)IAC;
+        } else {
+            c->data[n++]=(char)(128+rng()%127);
+        }
+    }
+    c->len=n;
+}
+
+/* login handshakes: options, NAWS/TTYPE subnegotiations and short lines */
+static void make_negotiation(struct corpus *c) {
+    static const char handshake[]=
+        "\377\375\30\377\375\37\377\375\47\377\373\3\377\373\1"
+        "\377\374\42\377\376\42\377\372\37\0\120\0\30\377\360"
+        "\377\372\30\0xterm-256color\377\360"
+        "\377\372\47\0\0USER\1guest\3COLORTERM\1truecolor\377\360"
+        "look\r\n\377\361\377\371say hi\r\n\377\366";
+    size_t n=0;
+
+    c->name="negotiate";
+    c->data=malloc(CORPUS_SIZE+sizeof(handshake));
+    while(n<CORPUS_SIZE) {
+        n=append(c->data, n, sizeof(handshake)-1, handshake);
+    }
+    c->len=n;
+}
+
+/* GMCP style subnegotiations with 4K payloads */
+static void make_large_sb(struct corpus *c) {
+    static const char head[]="\377\372\311Char.Vitals {\"hp\": ";
+    size_t n=0, i;
+
+    c->name="large-sb";
+    c->data=malloc(CORPUS_SIZE+8192);
+    while(n<CORPUS_SIZE) {
+        n=append(c->data, n, sizeof(head)-1, head);
+        for(i=0;i<4096;i++) {
+            c->data[n++]=(char)('0'+rng()%10);
+        }
+        n=append(c->data, n, 4, "}\377\360\n");
+    }
+    c->len=n;
+}
+
+static size_t run_classic(struct telnet_info *ts, size_t len, char *buf) {
+    size_t events=0;
+
+    telnet_begin(ts, len, buf);
+    while(telnet_continue(ts)) {
+        const char *text;
+        size_t text_len, exlen;
+        const unsigned char *ex;
+        unsigned char cmd, opt;
+
+        if(telnet_gettext(ts, &text_len, &text) && text_len) {
+            checksum+=text_len;
+            events++;
+        }
+        if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+            checksum+=cmd+opt+exlen;
+            events++;
+        }
+    }
+    telnet_end(ts);
+    return events;
+}
+
+static size_t run_batch(struct telnet_info *ts, size_t len, char *buf) {
+    struct telnet_event ev[64];
+    size_t events=0;
+    int i, n;
+
+    telnet_begin(ts, len, buf);
+    while(telnet_continue(ts)) {
+        n=telnet_parse_batch(ts, ev, 64);
+        for(i=0;i<n;i++) {
+            checksum+=ev[i].len+ev[i].command;
+        }
+        events+=n;
+    }
+    telnet_end(ts);
+    return events;
+}
+
+static size_t run_inplace(struct telnet_info *ts, size_t len, char *buf) {
+    size_t events=0;
+
+    telnet_begin_inplace(ts, len, buf);
+    while(telnet_continue(ts)) {
+        const char *text;
+        size_t text_len, exlen;
+        const unsigned char *ex;
+        unsigned char cmd, opt;
+
+        if(telnet_gettext(ts, &text_len, &text) && text_len) {
+            checksum+=text_len;
+            events++;
+        }
+        if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+            checksum+=cmd+opt+exlen;
+            events++;
+        }
+    }
+    telnet_end(ts);
+    return events;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+static unsigned long long ticks(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void bench(const struct corpus *c, size_t frag, const struct decoder *d, double seconds) {
+    struct telnet_info *ts=telnet_create(8192);
+    char *work=malloc(c->len);
+    size_t pos, len, events=0, bytes=0;
+    double start, elapsed=0, cycles=0;
+    unsigned long long t0;
+
+    telnet_setflags(ts, TelnetFlagSbGrow);
+    do {
+        /* in-place decoding rewrites the buffer, so every pass gets a copy.
+         * copying is kept out of the timings.
+         */
+        memcpy(work, c->data, c->len);
+        t0=ticks();
+        start=now();
+        for(pos=0;pos<c->len;pos+=len) {
+            len=c->len-pos<frag ? c->len-pos : frag;
+            events+=d->run(ts, len, work+pos);
+        }
+        elapsed+=now()-start;
+        cycles+=(double)(ticks()-t0);
+        bytes+=c->len;
+    } while(elapsed<seconds);
+
+    printf("%-10s %7lu %-8s %8.3f %10.2f", c->name, (unsigned long)frag, d->name,
+        bytes/elapsed/1e9, events ? elapsed*1e9/events : 0.0);
+#ifdef HAVE_RDTSC
+    printf(" %11.3f", cycles/bytes);
+#else
+    printf(" %11s", "-");
+#endif
+    printf(" %10lu\n", (unsigned long)events);
+    free(work);
+    telnet_free(ts);
+}
+
+int main(int argc, char **argv) {
+    static const struct decoder decoders[]={
+        { "classic", run_classic },
+        { "batch", run_batch },
+        { "inplace", run_inplace },
+    };
+    struct corpus corpora[4];
+    size_t frags[4]={ 1, 7, 1448, 0 };
+    double seconds=argc>1 ? atof(argv[1]) : 0.2;
+    unsigned i, j, k;
+
+    make_ascii(&corpora[0]);
+    make_iac_dense(&corpora[1]);
+    make_negotiation(&corpora[2]);
+    make_large_sb(&corpora[3]);
+
+    printf("%-10s %7s %-8s %8s %10s %11s %10s\n",
+        "corpus", "frag", "decoder", "GB/s", "ns/event", "cycles/byte", "events");
+    for(i=0;i<sizeof(corpora)/sizeof(*corpora);i++) {
+        for(j=0;j<sizeof(frags)/sizeof(*frags);j++) {
+            for(k=0;k<sizeof(decoders)/sizeof(*decoders);k++) {
+                bench(&corpora[i], frags[j] ? frags[j] : corpora[i].len, &decoders[k], seconds);
+            }
+        }
+        free(corpora[i].data);
+    }
+    fprintf(stderr, "checksum %llu\n", checksum);
+    return 0;
+}
@@ -1,127 +1,1301 @@
+#define _GNU_SOURCE
 #define JDM_TELNET_IMPLEMENTATION
-// #define JDM_TELNET_DEBUG
+#define JDM_TELNET_STATS
+#define JDM_TELNET_TRACE
 #include "jdm_telnet.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/io_uring.h>
+
+// multishot recv needs Linux 6.0 headers, the kernel is checked at runtime
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+#endif
+
+// USAGE:
+//  example [-p port] [-t threads] [-u] [-v] [-k seconds] [-i seconds]
+//          [-T trace [-N n]]
+//
+//  -p port     port to listen on (default 3000)
+//  -t threads  number of reactor threads (default 1). each thread has its
+//              own SO_REUSEPORT listener, epoll set and telnet_pool, and a
+//              connection stays on the thread that accepted it.
+//  -u          use io_uring instead of epoll: multishot accept, multishot
+//              recv into a provided buffer ring and one writev in flight per
+//              client, queued with the next wait, so a busy shard makes
+//              about one syscall per batch of completions. falls back to
+//              epoll when unsupported.
+//  -v          print every text and control event
+//  -k seconds  after this long without input send IAC NOP IAC AYT, and
+//              close the connection if nothing at all comes back within
+//              as long again (default 60, 0 for never)
+//  -i seconds  close connections that have not sent a line for this long
+//              (default 0, never)
+//  -T trace    append the input of connections to the file trace, for
+//              replay_telnet
+//  -N n        trace one connection in n (default 1, every connection)
+//
+//  clients can send "/wall <text>" to write text to every connection and
+//  "/kick <shard>:<fd>" to close one, and "/stats" to have every shard
+//  print the parser counters of its clients, open and closed. all of them
+//  go to the other shards as messages, so no shard ever touches another
+//  shard's clients. /wall text
+//  is escaped once into a telnet_frame that every client queues by
+//  reference.
+//
+//  output goes through a telnet_outq per client and is written once per
+//  loop iteration. a client that stops reading is not read from either
+//  once its queue passes OUTQ_HIGH, and misses broadcasts, until the queue
+//  is back under OUTQ_LOW. IAC AO and IAC IP drop whatever is still queued.
+//
+//  every client has one timer in a hierarchical timing wheel per shard,
+//  WHEEL_LEVELS wheels of WHEEL_SLOTS slots where each slot of a level
+//  spans a whole turn of the level below. arming, re-arming on input and
+//  cancelling are a list unlink and link, and each tick only looks at the
+//  one slot that is due, so nothing ever walks the connection table.
+
+#define READ_BUF_SIZE (64 * 1024)
+#define LINE_SIZE 1024 // per connection line ring
+#define MAX_EVENTS 256
+#define OUTQ_SEG 4096 // output queue segment size
+#define OUTQ_LOW (16 * 1024)
+#define OUTQ_HIGH (64 * 1024)
+#define URING_IOV 8 // segments per writev
+#define TICK_MS 100 // timer resolution
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^24 ticks, about 19 days
+#define WHEEL_RUN (WHEEL_LEVELS * WHEEL_SLOTS) // list of timers being run
+
 struct client {
-	int fd; // 0 means client is not valid / unused
+	int fd; // -1 means client is not valid / unused
+	unsigned gen; // bumped on close, tells stale io_uring completions apart
 	struct telnet_info *ts;
+	struct telnet_linebuf *lb;
+	struct telnet_outq *outq;
+	int dirty; // on the reactor's dirty list
+	int paused; // input is left in the socket until outq drains
+	int rdhup; // epoll: the peer shut down writing, read until EOF
+	int writing; // io_uring: a writev from outq is in flight
+	int discard; // io_uring: AO or IP arrived during the writev
+	int closing; // io_uring: close when the writev completes
+	struct iovec iov[URING_IOV]; // io_uring: what the writev is sending
+	// timer list links are indexes into clients[], which moves as it grows
+	int tslot; // list head in the reactor's wheel, -1 when not armed
+	int tnext, tprev; // -1 at either end
+	uint64_t expires; // tick
+	uint64_t last_line; // tick of the last complete line, for -i
+	uint64_t keepalive; // tick the next probe is due, 0 without -k
+	int probing; // IAC AYT sent, waiting for any input
 };
 
-static struct client *clients;
-static int max_clients = 400;
+enum msg_type {
+	MSG_BROADCAST, // write frame to every client
+	MSG_KICK, // close fd
+	MSG_STATS, // print telnet_stats
+};
+
+struct msg {
+	struct msg *next;
+	enum msg_type type;
+	int fd;
+	struct telnet_frame *frame; // MSG_BROADCAST, the message holds a reference
+};
+
+// lock-free multiple producer, single consumer queue (Dmitry Vyukov's
+// intrusive MPSC). producers swap themselves into head and then link the
+// previous node, the owning shard pops from tail.
+struct mpsc {
+	struct msg *head; // last pushed, written by producers
+	struct msg *tail; // next to pop, owned by the consumer
+	struct msg stub;
+};
 
-int main()
+// one epoll loop with its own listener, clients and telnet states
+struct reactor {
+	int id;
+	int epfd;
+	int listen_fd;
+	int efd; // eventfd, written after pushing to inbox
+	struct mpsc inbox;
+	struct uring *ring; // NULL when using epoll
+	pthread_t thread;
+	struct client *clients; // indexed by fd
+	int max_clients; // grows on demand
+	int nclients;
+	struct telnet_pool *pool;
+	char *buf; // shared by every client, data is parsed before the next read
+	int *dirty; // fds with output queued since the last flush
+	int ndirty;
+	struct telnet_stats closed; // counters of the clients closed so far
+	unsigned long accepted; // connections so far, picks the ones to trace
+	uint64_t tick; // next tick of the wheel to run
+	int ntimers; // armed timers
+	int wheel[WHEEL_RUN + 1]; // first client of every slot, -1 if empty
+};
+
+static int verbose;
+static struct telnet_trace *trace; // -T, shared by every shard
+static unsigned long trace_every = 1;
+static uint64_t keepalive_ticks = 60 * 1000 / TICK_MS; // -k, 0 means off
+static uint64_t idle_ticks; // -i, 0 means off
+static struct reactor *shards;
+static int nshards = 1;
+
+static void mpsc_init(struct mpsc *q)
 {
-	int e;
-	int port = 3000;
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+// safe from any thread
+static void mpsc_push(struct mpsc *q, struct msg *m)
+{
+	struct msg *prev;
+
+	m->next = NULL;
+	prev = __atomic_exchange_n(&q->head, m, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+// consumer only. returns NULL when empty, or when a producer is between its
+// two steps; that producer signals the eventfd afterwards.
+static struct msg *mpsc_pop(struct mpsc *q)
+{
+	struct msg *tail = q->tail;
+	struct msg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	// tail is the last node, put the stub behind it so it can be taken
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+#ifdef HAVE_URING
+#define URING_ENTRIES 1024
+#define URING_BUFS 256 // provided buffers per shard, a power of 2
+#define URING_BUF_SIZE (16 * 1024)
+
+// kind of request, in the low 3 bits of user_data
+enum uring_tag {
+	TAG_ACCEPT,
+	TAG_RECV, // gen << 32 | fd << 3
+	TAG_SEND, // gen << 32 | fd << 3, a writev from the client's outq
+	TAG_INBOX,
+	TAG_TIMER, // a TICK_MS timeout
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+	struct io_uring_buf_ring *br; // provided buffers, group 0
+	unsigned short br_tail;
+	char *bufs;
+	struct __kernel_timespec tick; // read by the kernel for every TAG_TIMER
+};
+
+// give buffer bid back to the kernel, seen after uring_buf_publish()
+static void uring_buf_recycle(struct uring *u, unsigned bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+
+	b->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	u->br_tail++;
+}
+
+static void uring_buf_publish(struct uring *u)
+{
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_fini(struct uring *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_size);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_size);
+	if (u->br && u->br != MAP_FAILED)
+		munmap(u->br, URING_BUFS * sizeof(struct io_uring_buf));
+	free(u->bufs);
+	close(u->fd);
+}
+
+static int uring_init(struct uring *u)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned i, *array;
+	char *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd < 0)
+		return perror("io_uring_setup()"), -1;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	u->cq_ring = u->sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	array = (unsigned *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i; // slot i always holds sqes[i]
+	cq = u->cq_ring;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// the kernel picks one of these buffers for each recv completion
+	u->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	if (u->br == MAP_FAILED || !u->bufs)
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		perror("IORING_REGISTER_PBUF_RING");
+		goto fail;
+	}
+	for (i = 0; i < URING_BUFS; i++)
+		uring_buf_recycle(u, i);
+	uring_buf_publish(u);
+	return 0;
+fail:
+	uring_fini(u);
+	return -1;
+}
+
+// submit what is queued, and wait for at least wait completions
+static int uring_enter(struct uring *u, unsigned wait)
+{
+	int n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	if (n >= 0)
+		u->to_submit -= n;
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		perror("io_uring_enter()");
+	return n;
+}
+
+// get a cleared SQE. nothing reaches the kernel before the next uring_enter()
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask)
+		uring_enter(u, 0); // full, hand the queue over first
+	sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static void uring_accept(struct reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = r->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = TAG_ACCEPT;
+}
+
+static void uring_recv(struct reactor *r, struct client *cl)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cl->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uint64_t)cl->gen << 32 | (uint64_t)cl->fd << 3 | TAG_RECV;
+}
+
+static void uring_inbox(struct reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r->ring);
 
-	// initialize clients
-	clients = calloc(max_clients, sizeof(*clients));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = r->efd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = TAG_INBOX;
+}
 
-	// setup server's listen socket
-	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_fd < 0)
-		return perror("socket()"), 1;
+// wake up after a tick even when nothing else completes
+static void uring_timer(struct reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r->ring);
+
+	r->ring->tick.tv_sec = 0;
+	r->ring->tick.tv_nsec = TICK_MS * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&r->ring->tick;
+	sqe->len = 1;
+	sqe->user_data = TAG_TIMER;
+}
+
+// send the front of the output queue. the segments stay in outq, and are
+// not touched, until the write completes.
+static void uring_writev(struct reactor *r, struct client *cl)
+{
+	struct io_uring_sqe *sqe;
+	int n = telnet_outq_peek(cl->outq, cl->iov, URING_IOV);
+
+	if (!n)
+		return;
+	sqe = uring_sqe(r->ring);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = cl->fd;
+	sqe->addr = (uintptr_t)cl->iov;
+	sqe->len = n;
+	sqe->user_data = (uint64_t)cl->gen << 32 | (uint64_t)cl->fd << 3 | TAG_SEND;
+	cl->writing = 1;
+}
+#endif
+
+// create a non-blocking listening socket on port
+static int listen_socket(int port)
+{
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	struct sockaddr_in listenaddr = {
+		.sin_family = AF_INET,
 		.sin_addr.s_addr = INADDR_ANY,
 		.sin_port = htons(port),
 	};
-	e = bind(server_fd, (struct sockaddr*)&listenaddr, sizeof(listenaddr));
-	if (e)
-		return perror("bind()"), 1;
-	listen(server_fd, 6);
-	printf("Listening on *:%u\n", port);
-
-	// server's listen loop
-	int maxfd;
-	fd_set rfds;
+
+	if (fd < 0)
+		return perror("socket()"), -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	// every shard binds the same port, the kernel spreads connections
+	if (nshards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+		return perror("SO_REUSEPORT"), close(fd), -1;
+	if (bind(fd, (struct sockaddr*)&listenaddr, sizeof(listenaddr)))
+		return perror("bind()"), close(fd), -1;
+	if (listen(fd, SOMAXCONN))
+		return perror("listen()"), close(fd), -1;
+	return fd;
+}
+
+// make sure clients[fd] exists
+static int reactor_reserve(struct reactor *r, int fd)
+{
+	int n = r->max_clients ? r->max_clients : 64;
+	struct client *p;
+	int *dirty;
 	int i;
 
-	while (1) {
-		// initialize activate clients
-		FD_ZERO(&rfds);
-		maxfd = server_fd;
-		for (i = 0; i < max_clients; i++) {
-			if (!clients[i].fd)
-				continue; // ignore unused clients
-			FD_SET(i, &rfds);
-			if (i > maxfd)
-				maxfd = i;
-		}
-		FD_SET(server_fd, &rfds);
-
-		// wait for server activity
-		e = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-		if (e < 0)
-			perror("select()");
-		if (FD_ISSET(server_fd, &rfds)) { // accept new connection...
-			struct sockaddr_in addr;
-			socklen_t len = sizeof(addr);
-			int newfd = accept(server_fd, (struct sockaddr*)&addr, &len);
-
-			if (newfd < 0) {
-				perror("accept");
-			} else if (newfd >= max_clients) {
-				close(newfd);
-				fprintf(stderr, "ignored connection - too many clients!\n");
-			} else {
-				struct client *cl = &clients[newfd];
-				cl->ts = telnet_create(80);
-				cl->fd = newfd;
-				printf("[%d] new connection\n", newfd);
-			}
-		} else { // process input from a client connection
-			char buf[128];
-			ssize_t buf_len;
-			for (i = 0; i < max_clients; i++) {
-				struct client *cl = &clients[i];
-
-				if (cl->fd <= 0)
-					continue; // not a valid client
-
-				if (!FD_ISSET(i, &rfds))
-					continue; // no data
-
-				// read buffer
-				buf_len = read(cl->fd, buf, sizeof(buf));
-				if (buf_len == 0) { // closed?
-					telnet_free(cl->ts);
-					cl->ts = NULL;
-					close(cl->fd);
-					cl->fd = 0;
+	if (fd < r->max_clients)
+		return 0;
+	while (n <= fd)
+		n *= 2;
+	// every fd is on the dirty list at most once
+	dirty = realloc(r->dirty, n * sizeof(*dirty));
+	if (!dirty)
+		return -1;
+	r->dirty = dirty;
+	p = realloc(r->clients, n * sizeof(*p));
+	if (!p)
+		return -1;
+	for (i = r->max_clients; i < n; i++) {
+		memset(&p[i], 0, sizeof(p[i]));
+		p[i].fd = -1;
+		p[i].tslot = -1;
+	}
+	r->clients = p;
+	r->max_clients = n;
+	return 0;
+}
+
+static uint64_t clock_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+static void timer_link(struct reactor *r, struct client *cl, int slot)
+{
+	int i = cl - r->clients;
+
+	cl->tslot = slot;
+	cl->tprev = -1;
+	cl->tnext = r->wheel[slot];
+	if (cl->tnext >= 0)
+		r->clients[cl->tnext].tprev = i;
+	r->wheel[slot] = i;
+	r->ntimers++;
+}
+
+static void timer_cancel(struct reactor *r, struct client *cl)
+{
+	if (cl->tslot < 0)
+		return;
+	if (cl->tprev >= 0)
+		r->clients[cl->tprev].tnext = cl->tnext;
+	else
+		r->wheel[cl->tslot] = cl->tnext;
+	if (cl->tnext >= 0)
+		r->clients[cl->tnext].tprev = cl->tprev;
+	cl->tslot = -1;
+	r->ntimers--;
+}
+
+// the lowest level whose turn covers the wait, in the slot of that level
+// that the expiry falls in. a slot above level 0 is moved down when the
+// level below wraps around to it.
+static void timer_place(struct reactor *r, struct client *cl)
+{
+	uint64_t delta;
+	int level = 0;
+
+	if (cl->expires < r->tick)
+		cl->expires = r->tick; // late, runs on the next tick
+	delta = cl->expires - r->tick;
+	if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+		delta = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+		cl->expires = r->tick + delta;
+	}
+	while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+		level++;
+	timer_link(r, cl, level * WHEEL_SLOTS + ((cl->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)));
+}
+
+// (re-)arm the timer of cl for an absolute tick
+static void timer_arm(struct reactor *r, struct client *cl, uint64_t expires)
+{
+	if (cl->tslot >= 0 && cl->expires == expires)
+		return;
+	timer_cancel(r, cl);
+	cl->expires = expires;
+	timer_place(r, cl);
+}
+
+// arm cl for whichever of the keepalive and the idle limit comes first
+static void client_timer(struct reactor *r, struct client *cl)
+{
+	uint64_t expires = cl->keepalive;
+
+	if (idle_ticks && (!expires || cl->last_line + idle_ticks < expires))
+		expires = cl->last_line + idle_ticks;
+	if (expires)
+		timer_arm(r, cl, expires);
+}
+
+static int reactor_init(struct reactor *r, int id, int listen_fd, int use_uring)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = listen_fd };
+
+	memset(r, 0, sizeof(*r));
+	memset(r->wheel, -1, sizeof(r->wheel));
+	r->tick = clock_ticks();
+	r->id = id;
+	r->listen_fd = listen_fd;
+	mpsc_init(&r->inbox);
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->efd < 0)
+		return perror("eventfd()"), -1;
+	r->pool = telnet_pool_create(80, 256);
+	if (!r->pool)
+		return fprintf(stderr, "out of memory\n"), -1;
+
+	if (use_uring) {
+#ifdef HAVE_URING
+		r->ring = malloc(sizeof(*r->ring));
+		if (r->ring && !uring_init(r->ring)) {
+			uring_accept(r);
+			uring_inbox(r);
+			uring_timer(r);
+			return 0;
+		}
+		free(r->ring);
+		r->ring = NULL;
+#endif
+		fprintf(stderr, "io_uring is not available, using epoll\n");
+	}
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+		return perror("epoll_create1()"), -1;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listen_fd, &ev))
+		return perror("epoll_ctl()"), -1;
+	ev.data.fd = r->efd;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->efd, &ev))
+		return perror("epoll_ctl()"), -1;
+	r->buf = malloc(READ_BUF_SIZE);
+	if (!r->buf)
+		return fprintf(stderr, "out of memory\n"), -1;
+	return 0;
+}
+
+// remember to flush cl at the end of this loop iteration
+static void client_dirty(struct reactor *r, struct client *cl)
+{
+	if (!cl->dirty) {
+		cl->dirty = 1;
+		r->dirty[r->ndirty++] = cl->fd;
+	}
+}
+
+// queue encoded TELNET commands
+static void client_send(struct reactor *r, struct client *cl, size_t len, const void *data)
+{
+	if (!telnet_outq_raw(cl->outq, len, data))
+		fprintf(stderr, "[%d:%d] out of memory, output dropped\n", r->id, cl->fd);
+	client_dirty(r, cl);
+}
+
+// queue a shared frame, only a pointer is added to outq
+static void client_frame(struct reactor *r, struct client *cl, struct telnet_frame *frame)
+{
+	if (!telnet_outq_frame(cl->outq, frame))
+		fprintf(stderr, "[%d:%d] out of memory, output dropped\n", r->id, cl->fd);
+	client_dirty(r, cl);
+}
+
+// IAC AO or IAC IP: the client does not want to see the rest
+static void client_discard(struct client *cl)
+{
+	if (cl->writing)
+		cl->discard = 1; // the kernel is still reading the front segments
+	else
+		telnet_outq_discard(cl->outq);
+}
+
+static void client_close(struct reactor *r, struct client *cl)
+{
+	// close() drops the fd from the epoll set. io_uring requests hold their
+	// own reference to the socket, shutdown() ends the pending recv. outq
+	// has to outlive a writev in flight, and so does the fd, so that its
+	// slot is not reused before the completion arrives.
+	if (r->ring)
+		shutdown(cl->fd, SHUT_RDWR);
+	if (cl->writing) {
+		cl->closing = 1;
+		return;
+	}
+	if (verbose)
+		printf("[%d:%d] closed\n", r->id, cl->fd);
+	timer_cancel(r, cl);
+	close(cl->fd);
+	telnet_stats_add(&r->closed, telnet_getstats(cl->ts));
+	telnet_pool_release(r->pool, cl->ts);
+	telnet_linebuf_free(cl->lb);
+	telnet_outq_free(cl->outq);
+	cl->ts = NULL;
+	cl->lb = NULL;
+	cl->outq = NULL;
+	cl->paused = 0;
+	cl->rdhup = 0;
+	cl->discard = 0;
+	cl->closing = 0;
+	cl->probing = 0;
+	cl->fd = -1;
+	cl->gen++;
+	r->nclients--;
+}
+
+static struct client *client_open(struct reactor *r, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+	unsigned char out[6];
+	size_t n;
+	struct client *cl;
+
+	if (reactor_reserve(r, fd))
+		return NULL;
+	cl = &r->clients[fd];
+	cl->ts = telnet_pool_acquire(r->pool);
+	cl->lb = telnet_linebuf_create(LINE_SIZE);
+	cl->outq = telnet_outq_create(OUTQ_SEG, OUTQ_LOW, OUTQ_HIGH);
+	if (!cl->ts || !cl->lb || !cl->outq)
+		goto fail;
+	if (!r->ring && epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl()");
+		goto fail;
+	}
+	cl->fd = fd;
+	r->nclients++;
+#ifdef HAVE_URING
+	if (r->ring)
+		uring_recv(r, cl);
+#endif
+
+	// character at a time, and ask for the window size
+	telnet_q_allow(cl->ts, TELOPT_SGA, 1, 1);
+	telnet_q_allow(cl->ts, TELOPT_NAWS, 0, 1);
+	n = telnet_q_request_us(cl->ts, TELOPT_SGA, 1, out);
+	n += telnet_q_request_him(cl->ts, TELOPT_NAWS, 1, out + n);
+	client_send(r, cl, n, out);
+
+	// input comes back as whole lines
+	telnet_setlinebuf(cl->ts, cl->lb);
+
+	cl->last_line = r->tick;
+	cl->keepalive = keepalive_ticks ? r->tick + keepalive_ticks : 0;
+	client_timer(r, cl);
+
+	if (trace && r->accepted % trace_every == 0) {
+		// shard in the top byte keeps ids unique across shards
+		unsigned long conn = (unsigned long)r->id << 24 | (r->accepted & 0xffffff);
+
+		telnet_settrace(cl->ts, trace, conn);
+		if (verbose)
+			printf("[%d:%d] traced as conn %lu\n", r->id, fd, conn);
+	}
+	r->accepted++;
+	return cl;
+fail:
+	telnet_pool_release(r->pool, cl->ts);
+	telnet_linebuf_free(cl->lb);
+	telnet_outq_free(cl->outq);
+	cl->ts = NULL;
+	cl->lb = NULL;
+	cl->outq = NULL;
+	return NULL;
+}
+
+// hand a message to another shard, or to this one
+static void reactor_post(struct reactor *to, enum msg_type type, int fd, struct telnet_frame *frame)
+{
+	struct msg *m = malloc(sizeof(*m));
+	uint64_t one = 1;
+
+	if (!m)
+		return;
+	m->type = type;
+	m->fd = fd;
+	m->frame = frame ? telnet_frame_ref(frame) : NULL;
+	mpsc_push(&to->inbox, m);
+	if (write(to->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+// one line of totals over every client this shard has had
+static void reactor_stats(struct reactor *r)
+{
+	struct telnet_stats sum = r->closed;
+	unsigned long commands = 0, negotiations = 0;
+	unsigned i;
+	int fd;
+
+	for (fd = 0; fd < r->max_clients; fd++) {
+		if (r->clients[fd].fd >= 0)
+			telnet_stats_add(&sum, telnet_getstats(r->clients[fd].ts));
+	}
+	for (i = 0; i < sizeof(sum.commands) / sizeof(*sum.commands); i++)
+		commands += sum.commands[i];
+	for (i = 0; i < sizeof(sum.negotiations) / sizeof(*sum.negotiations); i++)
+		negotiations += sum.negotiations[i];
+	printf("[%d] text=%llu escapes=%lu commands=%lu negotiations=%lu sb=%lu sb_bytes=%llu truncated=%lu unknown=%lu errors=%lu\n",
+	       r->id, sum.text_bytes, sum.iac_escapes, commands, negotiations, sum.sb_frames,
+	       sum.sb_bytes, sum.sb_truncated, sum.unknown, sum.errors);
+	fflush(stdout);
+}
+
+// run the messages other shards sent us
+static void reactor_inbox(struct reactor *r)
+{
+	struct msg *m;
+	uint64_t count;
+	int fd;
+
+	// reset the eventfd first, so a push that lands while draining wakes us again
+	if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+	while ((m = mpsc_pop(&r->inbox))) {
+		switch (m->type) {
+		case MSG_BROADCAST:
+			for (fd = 0; fd < r->max_clients; fd++) {
+				struct client *cl = &r->clients[fd];
+
+				if (cl->fd < 0 || cl->closing)
+					continue;
+				if (telnet_outq_throttled(cl->outq)) {
+					if (verbose)
+						printf("[%d:%d] slow reader, broadcast dropped\n", r->id, fd);
 					continue;
 				}
+				client_frame(r, cl, m->frame);
+			}
+			break;
+		case MSG_KICK:
+			if (m->fd >= 0 && m->fd < r->max_clients && r->clients[m->fd].fd >= 0)
+				client_close(r, &r->clients[m->fd]);
+			break;
+		case MSG_STATS:
+			reactor_stats(r);
+			break;
+		}
+		telnet_frame_unref(m->frame);
+		free(m);
+	}
+}
+
+// "/wall <text>", "/kick <shard>:<fd>" and "/stats"
+static void client_command(size_t len, const char *text)
+{
+	int i, shard, fd;
+	char tmp[32];
+	struct telnet_frame *frame;
+
+	if (len > 6 && !memcmp(text, "/wall ", 6)) {
+		// escaped once here, every shard queues it by reference
+		frame = telnet_frame_create(len - 6, text + 6);
+		if (!frame)
+			return;
+		for (i = 0; i < nshards; i++)
+			reactor_post(&shards[i], MSG_BROADCAST, -1, frame);
+		telnet_frame_unref(frame);
+	} else if (len > 6 && !memcmp(text, "/kick ", 6)) {
+		len = len - 6 < sizeof(tmp) - 1 ? len - 6 : sizeof(tmp) - 1;
+		memcpy(tmp, text + 6, len);
+		tmp[len] = 0;
+		if (sscanf(tmp, "%d:%d", &shard, &fd) == 2 && shard >= 0 && shard < nshards)
+			reactor_post(&shards[shard], MSG_KICK, fd, NULL);
+	} else if (len >= 6 && !memcmp(text, "/stats", 6)) {
+		for (i = 0; i < nshards; i++)
+			reactor_post(&shards[i], MSG_STATS, -1, NULL);
+	}
+}
+
+// process TELNET codes in one buffer of input
+static void client_input(struct reactor *r, struct client *cl, size_t len, char *buf)
+{
+	struct telnet_event ev[64];
+	struct telnet_line lines[16];
+	struct telnet_naws naws;
+	char line[LINE_SIZE + 2];
+	unsigned char reply[3];
+	size_t reply_len, line_len;
+	int i, n;
 
-				// process TELNET codes
-				telnet_begin(cl->ts, buf_len, buf);
-				while (telnet_continue(cl->ts)) {
-					const char *text;
-					size_t text_len = 123;
-					if (telnet_gettext(cl->ts, &text_len, &text)) {
-						// TODO:
-						printf("[%d] len=%d text=\"%.*s\"\n", cl->fd, (int)text_len, (int)text_len, text);
-					}
-					unsigned char command, option;
-					const unsigned char *extra;
-					size_t extra_len;
-					if (telnet_getcontrol(cl->ts, &command, &option, &extra_len, &extra)) {
-						printf("[%d] command=%u option=%u len=%d\n", cl->fd, command, option, (int)extra_len);
-						// TODO:
-					}
+	telnet_begin(cl->ts, len, buf);
+	while (telnet_continue(cl->ts)) {
+		n = telnet_parse_batch(cl->ts, ev, 64);
+		for (i = 0; i < n; i++) {
+			switch (ev[i].type) {
+			case TelnetEventNegotiate:
+				reply_len = telnet_q_receive(cl->ts, ev[i].command, ev[i].option, reply);
+				if (reply_len)
+					client_send(r, cl, reply_len, reply);
+				if (verbose)
+					printf("[%d:%d] command=%u option=%u\n", r->id, cl->fd, ev[i].command, ev[i].option);
+				break;
+			case TelnetEventSubneg:
+				if (telnet_decode_naws(ev[i].len, ev[i].extra, &naws)) {
+					if (verbose)
+						printf("[%d:%d] window %ux%u\n", r->id, cl->fd, naws.width, naws.height);
+					break;
 				}
+				if (verbose)
+					printf("[%d:%d] subneg option=%u len=%u\n", r->id, cl->fd, ev[i].option, ev[i].len);
+				break;
+			case TelnetEventCommand:
+				if (ev[i].command == AO || ev[i].command == IP)
+					client_discard(cl);
+				if (verbose)
+					printf("[%d:%d] command=%u\n", r->id, cl->fd, ev[i].command);
+				break;
+			default:
+				if (verbose)
+					printf("[%d:%d] command=%u option=%u len=%u\n", r->id, cl->fd, ev[i].command, ev[i].option, ev[i].len);
+			}
+		}
+	}
+	telnet_end(cl->ts);
+
+	// any input answers an AYT and puts the keepalive off
+	cl->probing = 0;
+	cl->keepalive = keepalive_ticks ? r->tick + keepalive_ticks : 0;
 
-				telnet_end(cl->ts);
+	// every line this read completed
+	while ((n = telnet_linebuf_get(cl->lb, lines, 16)) > 0) {
+		cl->last_line = r->tick;
+		for (i = 0; i < n; i++) {
+			if (verbose)
+				printf("[%d:%d] line=\"%.*s%.*s\"\n", r->id, cl->fd,
+				       (int)lines[i].len[0], lines[i].text[0], (int)lines[i].len[1], lines[i].text[1] ? lines[i].text[1] : "");
+			if (lines[i].len[0] && lines[i].text[0][0] == '/') {
+				line_len = lines[i].len[0];
+				memcpy(line, lines[i].text[0], line_len);
+				if (lines[i].len[1]) {
+					memcpy(line + line_len, lines[i].text[1], lines[i].len[1]);
+					line_len += lines[i].len[1];
+				}
+				memcpy(line + line_len, "\r\n", 2);
+				client_command(line_len + 2, line);
 			}
 		}
 	}
+	client_timer(r, cl);
+}
+
+// read until the socket is empty, as edge-triggered epoll only reports new data.
+// a FIN that came with the last data gets no edge of its own, so once
+// EPOLLRDHUP was seen reads go on until the EOF.
+static void client_read(struct reactor *r, struct client *cl)
+{
+	ssize_t len;
+
+	while (1) {
+		if (telnet_outq_throttled(cl->outq)) {
+			cl->paused = 1; // picked up again by client_flush()
+			return;
+		}
+		len = read(cl->fd, r->buf, READ_BUF_SIZE);
+		if (len > 0) {
+			client_input(r, cl, len, r->buf);
+			if (len < READ_BUF_SIZE && !cl->rdhup)
+				return; // a short read means the socket is drained
+			continue;
+		}
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		client_close(r, cl); // EOF or error
+		return;
+	}
+}
+
+// write what is queued. with epoll the rest waits for EPOLLOUT, with
+// io_uring for the completion of the writev.
+static void client_flush(struct reactor *r, struct client *cl)
+{
+#ifdef HAVE_URING
+	if (r->ring) {
+		if (!cl->writing && !cl->closing)
+			uring_writev(r, cl);
+		return;
+	}
+#endif
+	while (1) {
+		if (telnet_outq_flush(cl->outq, cl->fd) < 0) {
+			client_close(r, cl);
+			return;
+		}
+		if (!cl->paused || telnet_outq_throttled(cl->outq))
+			return;
+		// drained enough, read what was held back and flush the answers
+		cl->paused = 0;
+		client_read(r, cl);
+		if (cl->fd < 0)
+			return;
+	}
+}
+
+// one write per client that queued output during this loop iteration
+static void reactor_flush(struct reactor *r)
+{
+	struct client *cl;
+	int i;
+
+	for (i = 0; i < r->ndirty; i++) {
+		cl = &r->clients[r->dirty[i]];
+		if (cl->fd >= 0)
+			client_flush(r, cl);
+		cl->dirty = 0;
+	}
+	r->ndirty = 0;
+}
+
+// the keepalive or the idle limit of cl is due
+static void client_timeout(struct reactor *r, struct client *cl)
+{
+	static const unsigned char probe[] = { IAC, NOP, IAC, AYT };
+
+	if (cl->closing)
+		return;
+	if (idle_ticks && r->tick - cl->last_line >= idle_ticks) {
+		if (verbose)
+			printf("[%d:%d] idle\n", r->id, cl->fd);
+		client_close(r, cl);
+		return;
+	}
+	if (cl->keepalive && r->tick >= cl->keepalive) {
+		if (cl->probing) {
+			if (verbose)
+				printf("[%d:%d] no answer to AYT\n", r->id, cl->fd);
+			client_close(r, cl);
+			return;
+		}
+		// NOP finds a dead peer when the write fails, AYT a live one that hung
+		client_send(r, cl, sizeof(probe), probe);
+		cl->probing = 1;
+		cl->keepalive = r->tick + keepalive_ticks;
+	}
+	client_timer(r, cl);
+}
+
+// run every tick up to now. the due slot is moved to the run list first,
+// so timeouts can re-arm or close freely.
+static void reactor_timers(struct reactor *r)
+{
+	uint64_t now = clock_ticks();
+	unsigned slot;
+	int level, i;
+
+	if (!r->ntimers) {
+		r->tick = now + 1;
+		return;
+	}
+	while (r->tick <= now) {
+		slot = r->tick & (WHEEL_SLOTS - 1);
+		// level 0 wrapped: spread the next slot of the level above over it
+		for (level = 1; !slot && level < WHEEL_LEVELS; level++) {
+			slot = (r->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+			while ((i = r->wheel[level * WHEEL_SLOTS + slot]) >= 0) {
+				timer_cancel(r, &r->clients[i]);
+				timer_place(r, &r->clients[i]);
+			}
+		}
+		slot = r->tick & (WHEEL_SLOTS - 1);
+		while ((i = r->wheel[slot]) >= 0) {
+			timer_cancel(r, &r->clients[i]);
+			timer_link(r, &r->clients[i], WHEEL_RUN);
+		}
+		r->tick++;
+		while ((i = r->wheel[WHEEL_RUN]) >= 0) {
+			timer_cancel(r, &r->clients[i]);
+			client_timeout(r, &r->clients[i]);
+		}
+	}
+}
+
+// epoll_wait() timeout in ms, up to the next tick
+static int reactor_timeout(struct reactor *r)
+{
+	struct timespec ts;
+	int64_t ms;
+
+	if (!r->ntimers)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ms = (int64_t)(r->tick * TICK_MS) - ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	return ms < 0 ? 0 : ms;
+}
+
+static void reactor_accept(struct reactor *r)
+{
+	while (1) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		int newfd = accept4(r->listen_fd, (struct sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (newfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4()"); // EMFILE and friends, retried on the next connection
+			return;
+		}
+		if (!client_open(r, newfd)) {
+			close(newfd);
+			fprintf(stderr, "ignored connection - out of memory!\n");
+			continue;
+		}
+		if (verbose)
+			printf("[%d:%d] new connection from %s\n", r->id, newfd, inet_ntoa(addr.sin_addr));
+	}
+}
+
+#ifdef HAVE_URING
+static void uring_complete(struct reactor *r, const struct io_uring_cqe *cqe)
+{
+	struct uring *u = r->ring;
+	uint64_t ud = cqe->user_data;
+	int res = cqe->res;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	struct client *cl;
+	unsigned bid;
+	int fd;
+
+	switch (ud & 7) {
+	case TAG_ACCEPT:
+		if (res >= 0) {
+			if (!client_open(r, res)) {
+				close(res);
+				fprintf(stderr, "ignored connection - out of memory!\n");
+			} else if (verbose) {
+				printf("[%d:%d] new connection\n", r->id, res);
+			}
+		} else if (res != -ECONNABORTED) {
+			fprintf(stderr, "accept: %s\n", strerror(-res));
+		}
+		if (!more)
+			uring_accept(r);
+		break;
+	case TAG_RECV:
+		fd = (ud >> 3) & 0x1fffffff;
+		cl = &r->clients[fd];
+		if (cl->fd != fd || cl->gen != ud >> 32 || cl->closing)
+			cl = NULL; // closed since the recv was queued
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (cl && res > 0)
+				client_input(r, cl, res, u->bufs + (size_t)bid * URING_BUF_SIZE);
+			uring_buf_recycle(u, bid);
+		}
+		if (!cl || cl->fd < 0)
+			break;
+		if (res > 0 || res == -ENOBUFS) {
+			// ENOBUFS: every buffer was in use, they are back by the next submit
+			if (more)
+				break;
+			if (telnet_outq_throttled(cl->outq))
+				cl->paused = 1; // re-armed when the writev drains outq
+			else
+				uring_recv(r, cl);
+		} else {
+			client_close(r, cl); // EOF or error
+		}
+		break;
+	case TAG_SEND:
+		fd = (ud >> 3) & 0x1fffffff;
+		cl = &r->clients[fd]; // the fd stays open while a writev is in flight
+		cl->writing = 0;
+		if (cl->closing || res < 0) {
+			client_close(r, cl);
+			break;
+		}
+		telnet_outq_consume(cl->outq, res);
+		if (cl->discard) {
+			cl->discard = 0;
+			telnet_outq_discard(cl->outq);
+		}
+		if (cl->paused && !telnet_outq_throttled(cl->outq)) {
+			cl->paused = 0;
+			uring_recv(r, cl);
+		}
+		uring_writev(r, cl); // the rest, or what was queued meanwhile
+		break;
+	case TAG_INBOX:
+		reactor_inbox(r);
+		if (!more)
+			uring_inbox(r);
+		break;
+	case TAG_TIMER:
+		reactor_timers(r);
+		uring_timer(r);
+		break;
+	}
+}
+
+static void uring_run(struct reactor *r)
+{
+	struct uring *u = r->ring;
+	unsigned head, tail;
+
+	while (1) {
+		uring_enter(u, 1);
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			uring_complete(r, &u->cqes[head & u->cq_mask]);
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		uring_buf_publish(u);
+		reactor_flush(r);
+	}
+}
+#endif
+
+static void *reactor_run(void *arg)
+{
+	struct reactor *r = arg;
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+#ifdef HAVE_URING
+	if (r->ring) {
+		uring_run(r);
+		return NULL;
+	}
+#endif
+	while (1) {
+		n = epoll_wait(r->epfd, events, MAX_EVENTS, reactor_timeout(r));
+		if (n < 0) {
+			if (errno != EINTR)
+				perror("epoll_wait()");
+			continue;
+		}
+		// first, so that timers armed below count from now
+		reactor_timers(r);
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			struct client *cl;
+
+			if (fd == r->listen_fd) {
+				reactor_accept(r);
+				continue;
+			}
+			if (fd == r->efd) {
+				reactor_inbox(r);
+				continue;
+			}
+			cl = &r->clients[fd];
+			if (cl->fd < 0)
+				continue; // closed earlier in this batch
+			if (events[i].events & EPOLLRDHUP)
+				cl->rdhup = 1;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+				client_read(r, cl);
+			if (cl->fd >= 0 && (events[i].events & EPOLLOUT))
+				client_flush(r, cl);
+			if (cl->fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+				client_close(r, cl);
+		}
+		reactor_flush(r);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int port = 3000;
+	int use_uring = 0;
+	int c, i, fd;
+
+	while ((c = getopt(argc, argv, "p:t:uvk:i:T:N:")) != -1) {
+		switch (c) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			nshards = atoi(optarg);
+			if (nshards < 1)
+				nshards = 1;
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			break;
+		case 'k':
+			keepalive_ticks = strtoull(optarg, NULL, 10) * 1000 / TICK_MS;
+			break;
+		case 'i':
+			idle_ticks = strtoull(optarg, NULL, 10) * 1000 / TICK_MS;
+			break;
+		case 'T':
+			trace = telnet_trace_open(optarg);
+			if (!trace) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'N':
+			trace_every = strtoul(optarg, NULL, 10);
+			if (trace_every < 1)
+				trace_every = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-t threads] [-u] [-v] [-k seconds] [-i seconds]\n"
+				"       [-T trace [-N n]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// setup a listen socket and reactor for every shard
+	shards = calloc(nshards, sizeof(*shards));
+	if (!shards)
+		return 1;
+	for (i = 0; i < nshards; i++) {
+		fd = listen_socket(port);
+		if (fd < 0)
+			return 1;
+		if (reactor_init(&shards[i], i, fd, use_uring))
+			return 1;
+	}
+	printf("Listening on *:%u with %d thread%s\n", port, nshards, nshards > 1 ? "s" : "");
+
+	// shard 0 runs on the main thread
+	for (i = 1; i < nshards; i++) {
+		if (pthread_create(&shards[i].thread, NULL, reactor_run, &shards[i]))
+			return fprintf(stderr, "pthread_create() failed\n"), 1;
+	}
+	reactor_run(&shards[0]);
 
 	return 0;
 }
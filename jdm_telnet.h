@@ -4,25 +4,80 @@
 /* USAGE:
  *
  * Define JDM_TELNET_IMPLEMENTATION in exactly one source file.
- * Optionally define JDM_TELNET_DEBUG for spammy debug prints.
+ * Optionally define JDM_TELNET_STATS for per connection counters, see
+ * telnet_getstats(), and JDM_TELNET_STATS_OPTIONS as well to also count
+ * negotiations by option, at 2K more per connection.
+ * Optionally define JDM_TELNET_TRACE to record input for replay_telnet, see
+ * telnet_settrace().
  * Include header in any number of source files.
  *
  * 1. telnet_create() to allocate the state handle.
+ *    (or telnet_init() into memory of telnet_sizeof() bytes, or
+ *    telnet_pool_acquire() from a telnet_pool_create() pool)
  * 2. acquire data from your network libraries (read(), recv())
  * 3. telnet_begin() to point to the current working buffer
+ *    (or telnet_beginv() to a list of them, e.g. a ring that wrapped)
  * 4. telnet_continue() to check if data is left in the working buffer.
  * 5. telnet_gettext() to get normal text from the stream.
  * 6. telnet_getcontrol() to get WILL/WONT/DO/DONT/SB options and sub-option data.
+ *    or telnet_parse_batch() to decode the buffer into an array of events.
  * 7. telnet_end() to stop pointing to the working buffer.
  * 8. when complete, free data with telnet_free()
+ *    (or telnet_fini() or telnet_pool_release() to match step 1)
+ *
+ * For whole lines instead of text:
+ * + telnet_linebuf_create() a ring per connection, telnet_setlinebuf() it.
+ * + text is absorbed and EC/EL applied, after telnet_end() take every
+ *   complete line with telnet_linebuf_get().
+ *
+ * To send:
+ * + telnet_escape_iov() to double IAC in outgoing text without copying it,
+ *   as a list of iovecs for writev(). telnet_escape() makes a copy instead.
+ * + telnet_encode_command(), telnet_encode_option() and
+ *   telnet_encode_subneg() to build IAC sequences.
+ *
+ * To read what the client tells about itself:
+ * + telnet_decode_naws() and telnet_decode_ttype() on a SB payload.
+ * + telnet_environ_begin() and telnet_environ_next() to walk NEW-ENVIRON
+ *   variables, telnet_slc_begin() and telnet_slc_next() for LINEMODE SLC.
+ *
+ * To queue output:
+ * + telnet_outq_create() per connection, telnet_outq_text() for text and
+ *   telnet_outq_raw() for encoded commands, then one telnet_outq_flush()
+ *   per event loop tick (or telnet_outq_peek()/telnet_outq_consume() for
+ *   completion based I/O). telnet_outq_throttled() says when to stop
+ *   producing for a slow reader, telnet_outq_discard() handles AO and IP.
+ * + for text that goes to many connections, telnet_frame_create() escapes
+ *   it once and telnet_outq_frame() queues it on each by reference. drop
+ *   the creator's reference with telnet_frame_unref() when done queueing,
+ *   the last queue to send it frees it.
+ *
+ * To compress output (MCCP2, define JDM_TELNET_MCCP and link zlib):
+ * + telnet_q_request_us() TELOPT_COMPRESS2, and once the client agrees send
+ *   telnet_mccp_start() and pass all further output, already escaped,
+ *   through telnet_mccp_compress() of a telnet_mccp_create() stream.
+ *   with an output queue, telnet_outq_setmccp() does the same as it sends.
+ * + telnet_outq_setmccp_shared() instead keeps no zlib state per
+ *   connection: frames are compressed once by telnet_frame_compress() and
+ *   everything else goes out in stored blocks.
+ * + telnet_outq_mccp_end() to end compression on a queue.
+ * + clients use telnet_rest() after IAC SB COMPRESS2 IAC SE and feed the
+ *   bytes to telnet_mccp_decompress() before telnet_begin().
+ *
+ * To negotiate options (RFC 1143 Q method):
+ * + telnet_q_allow() to pick the options the other end may turn on.
+ * + telnet_q_request_us() and telnet_q_request_him() to ask for changes.
+ * + telnet_q_receive() on each WILL/WONT/DO/DONT from telnet_getcontrol(),
+ *   sending whatever reply it writes.
+ * + telnet_q_enabled_us() and telnet_q_enabled_him() to check an option.
  *
  */
 /* BUGS & TODO:
  * + handle TCP Urgent/OOB state changes (like SYNCH)
  */
-/* EXAMPLE CODE:
+/* EXAMPLE CODE: (a minimal select() loop, example.c is an epoll server)
  * #define JDM_TELNET_IMPLEMENTATION
- * // #define JDM_TELNET_DEBUG
+ * // #define JDM_TELNET_STATS
  * #include "jdm_telnet.h"
  *
  * #include <stdlib.h>
@@ -197,27 +252,279 @@
 #ifndef JDM_TELNET_H_
 #define JDM_TELNET_H_
 #include <stddef.h>
+#include <sys/uio.h>
+#ifdef JDM_TELNET_TRACE
+#include <stdint.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct telnet_info;
 /* extra_max controls buffer for Subnegotiation */
 struct telnet_info *telnet_create(size_t extra_max);
+/* embed the state in caller memory instead of allocating it */
+size_t telnet_sizeof(size_t extra_max);
+struct telnet_info *telnet_init(void *mem, size_t extra_max);
+void telnet_fini(struct telnet_info *ts);
 int telnet_begin(struct telnet_info *ts, size_t inbuf_len, const char *inbuf);
+/* same as telnet_begin(), but IAC IAC is collapsed in place in inbuf */
+int telnet_begin_inplace(struct telnet_info *ts, size_t inbuf_len, char *inbuf);
+/* same as telnet_begin() over several buffers, e.g. the two halves of a
+ * wrapped ring. iov must stay valid until telnet_end().
+ */
+int telnet_beginv(struct telnet_info *ts, const struct iovec *iov, int iovcnt);
+int telnet_segment(const struct telnet_info *ts);
 int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr);
 int telnet_getcontrol(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra);
 int telnet_continue(struct telnet_info *ts);
+/* take the unparsed rest of the buffer, e.g. when it is compressed */
+size_t telnet_rest(struct telnet_info *ts, const char **rest);
+
+/* options for telnet_setflags() */
+enum telnet_flags {
+    TelnetFlagSbStream=1,       /* return long SB payloads in pieces */
+    TelnetFlagSbGrow=2,         /* move long SB payloads to a heap buffer */
+    TelnetFlagNewline=4,        /* NVT newlines: CR LF and bare LF are LF, CR NUL is CR */
+};
+void telnet_setflags(struct telnet_info *ts, int flags);
+int telnet_getflags(const struct telnet_info *ts);
+/* largest heap buffer TelnetFlagSbGrow will use */
+void telnet_setsblimit(struct telnet_info *ts, size_t limit);
+
+/* which piece of an SB payload the last telnet_getcontrol() returned */
+enum telnet_sbchunk {
+    TelnetSbBegin=1,            /* first piece of the payload */
+    TelnetSbEnd=2,              /* last piece, IAC SE was seen */
+};
+int telnet_sbchunk(const struct telnet_info *ts);
+
+/* event types filled in by telnet_parse_batch() */
+enum telnet_event_type {
+    TelnetEventText,            /* offset and len of text in inbuf, or extra */
+    TelnetEventCommand,         /* 2-byte IAC <command> */
+    TelnetEventNegotiate,       /* 3-byte IAC WILL/WONT/DO/DONT <option> */
+    TelnetEventSubneg,          /* IAC SB <option> ... IAC SE, payload in extra */
+};
+
+struct telnet_event {
+    unsigned char type;         /* enum telnet_event_type */
+    unsigned char command, option;
+    unsigned char flags;        /* TelnetEventSubneg: enum telnet_sbchunk */
+    unsigned len;               /* length of the text or of extra */
+    unsigned offset;            /* TelnetEventText: start of text in inbuf */
+    unsigned seg;               /* TelnetEventText: the iovec offset is in, for telnet_beginv() */
+    const unsigned char *extra; /* TelnetEventSubneg: payload. TelnetEventText:
+                                   NULL, or text that is not in inbuf */
+};
+
+int telnet_parse_batch(struct telnet_info *ts, struct telnet_event *events, int max_events);
 int telnet_end(struct telnet_info *ts);
 void telnet_free(struct telnet_info *ts);
 
+#ifdef JDM_TELNET_STATS
+/* counters kept by every state. they only ever count up. */
+struct telnet_stats {
+    unsigned long long text_bytes;  /* text returned, after unescaping */
+    unsigned long long sb_bytes;    /* SB payload returned, all pieces */
+    unsigned long iac_escapes;      /* IAC IAC in text */
+    unsigned long commands[20];     /* IAC <command>, see TELNET_STATS_CMD() */
+    unsigned long negotiations[4];  /* with their option, see TELNET_STATS_NEG() */
+    unsigned long sb_frames;        /* SB frames ended by IAC SE */
+    unsigned long sb_truncated;     /* SB frames that did not fit */
+    unsigned long unknown;          /* IAC followed by a code below xEOF */
+    unsigned long errors;           /* times the state was found broken */
+#ifdef JDM_TELNET_STATS_OPTIONS
+    unsigned long options[256];     /* negotiations, by option */
+#endif
+};
+/* commands[] index of xEOF (236) to DONT (254) */
+#define TELNET_STATS_CMD(command) ((command)-236)
+/* negotiations[] index of WILL, WONT, DO and DONT */
+#define TELNET_STATS_NEG(command) ((command)-251)
+const struct telnet_stats *telnet_getstats(const struct telnet_info *ts);
+/* add the counters of s to sum, e.g. over all connections */
+void telnet_stats_add(struct telnet_stats *sum, const struct telnet_stats *s);
+#endif
+
+#ifdef JDM_TELNET_TRACE
+/* a trace file is TELNET_TRACE_MAGIC then records, each a
+ * struct telnet_trace_record in native byte order followed by len bytes of
+ * input exactly as given to telnet_begin(). records are never aligned.
+ */
+#define TELNET_TRACE_MAGIC "JDMTRC01"
+enum telnet_trace_flags {
+    TelnetTraceStart=1,         /* telnet_settrace(), a new connection. len is 0 */
+    TelnetTraceMore=2,          /* the next record of conn is the same telnet_beginv() */
+};
+struct telnet_trace_record {
+    uint64_t time_ns;           /* CLOCK_REALTIME */
+    uint32_t conn;              /* as given to telnet_settrace() */
+    uint32_t flags;             /* enum telnet_trace_flags */
+    uint32_t len;
+    uint32_t reserved;          /* 0 */
+};
+struct telnet_trace;
+struct telnet_trace *telnet_trace_open(const char *filename);
+void telnet_trace_close(struct telnet_trace *tr);
+/* record every buffer ts is given from now on, or stop with NULL */
+void telnet_settrace(struct telnet_info *ts, struct telnet_trace *tr, unsigned long conn);
+#endif
+
+/* fixed size slab pool of telnet states */
+struct telnet_pool;
+struct telnet_pool *telnet_pool_create(size_t extra_max, size_t per_slab);
+struct telnet_info *telnet_pool_acquire(struct telnet_pool *pool);
+void telnet_pool_release(struct telnet_pool *pool, struct telnet_info *ts);
+void telnet_pool_free(struct telnet_pool *pool);
+
+/* cooked line mode: text is collected in a ring, EC and EL edit it, and
+ * whole lines come back as slices of the ring.
+ */
+struct telnet_linebuf;
+struct telnet_line {
+    const char *text[2];        /* the line is text[0] then text[1] */
+    size_t len[2];              /* len[1] is 0 unless the line wraps */
+};
+size_t telnet_linebuf_sizeof(size_t capacity);
+struct telnet_linebuf *telnet_linebuf_init(void *mem, size_t capacity);
+struct telnet_linebuf *telnet_linebuf_create(size_t capacity);
+void telnet_linebuf_free(struct telnet_linebuf *lb);
+void telnet_setlinebuf(struct telnet_info *ts, struct telnet_linebuf *lb);
+int telnet_linebuf_get(struct telnet_linebuf *lb, struct telnet_line *lines, int max_lines);
+size_t telnet_linebuf_dropped(const struct telnet_linebuf *lb);
+
+/* outbound encoding */
+int telnet_escape_iov(struct iovec *iov, int iov_max, size_t len, const char *text, size_t *consumed);
+size_t telnet_escape(char *out, size_t out_max, size_t len, const char *text, size_t *consumed);
+size_t telnet_encode_command(unsigned char *out, unsigned char command);
+size_t telnet_encode_option(unsigned char *out, unsigned char command, unsigned char option);
+size_t telnet_encode_subneg(unsigned char *out, size_t out_max, unsigned char option, size_t len, const unsigned char *data);
+
+/* decoders for the subnegotiations every login sends. len and sb are the
+ * whole payload from telnet_getcontrol() or a TelnetEventSubneg, option
+ * byte first. nothing is allocated or copied, names and values point into
+ * sb and are not terminated.
+ */
+struct telnet_naws {
+    unsigned width, height;     /* 0 means unknown */
+};
+int telnet_decode_naws(size_t len, const unsigned char *sb, struct telnet_naws *naws);
+int telnet_decode_ttype(size_t len, const unsigned char *sb, const char **name, size_t *name_len);
+
+/* position in a NEW-ENVIRON or LINEMODE SLC list */
+struct telnet_sbiter {
+    const unsigned char *p, *end;
+};
+
+/* one NEW-ENVIRON (RFC 1572) variable */
+struct telnet_environ {
+    unsigned char type;         /* NEW_ENV_VAR or ENV_USERVAR */
+    unsigned char has_value;    /* 0: no VALUE, the variable is undefined or asked for */
+    unsigned char escaped;      /* name or value holds ENV_ESC, see telnet_environ_unescape() */
+    const char *name, *value;
+    size_t name_len, value_len;
+};
+int telnet_environ_begin(struct telnet_sbiter *it, size_t len, const unsigned char *sb);
+int telnet_environ_next(struct telnet_sbiter *it, struct telnet_environ *var);
+size_t telnet_environ_unescape(char *out, size_t len, const char *in);
+
+/* one LINEMODE (RFC 1184) special character */
+struct telnet_slc {
+    unsigned char function;     /* SLC_xxx */
+    unsigned char flags;        /* SLC_LEVELBITS level, SLC_ACK, SLC_FLUSHxxx */
+    unsigned char value;        /* the character, 255 is IAC */
+};
+int telnet_slc_begin(struct telnet_sbiter *it, size_t len, const unsigned char *sb);
+int telnet_slc_next(struct telnet_sbiter *it, struct telnet_slc *slc);
+
+/* RFC 1143 option negotiation. "us" is this end, "him" is the peer.
+ * the functions that may answer write up to 3 bytes to out and return the
+ * number of bytes to send.
+ */
+void telnet_q_allow(struct telnet_info *ts, unsigned char option, int us, int him);
+size_t telnet_q_request_us(struct telnet_info *ts, unsigned char option, int enable, unsigned char *out);
+size_t telnet_q_request_him(struct telnet_info *ts, unsigned char option, int enable, unsigned char *out);
+size_t telnet_q_receive(struct telnet_info *ts, unsigned char command, unsigned char option, unsigned char *out);
+int telnet_q_enabled_us(const struct telnet_info *ts, unsigned char option);
+int telnet_q_enabled_him(const struct telnet_info *ts, unsigned char option);
+
+#ifdef JDM_TELNET_MCCP
+/* MCCP2, compression of everything the server sends (needs zlib) */
+#ifndef TELOPT_COMPRESS2
+#define TELOPT_COMPRESS2 86
+#endif
+
+enum telnet_mccp_flush {
+    TelnetMccpNone,             /* let zlib buffer as it likes */
+    TelnetMccpSync,             /* everything so far can be decompressed, for prompts/GA */
+    TelnetMccpFinish,           /* end compression, plain telnet follows */
+};
+
+struct telnet_mccp;
+struct telnet_mccp *telnet_mccp_create(int level, int window_bits, int mem_level);
+struct telnet_mccp *telnet_mccp_inflate_create(void);
+void telnet_mccp_free(struct telnet_mccp *mc);
+size_t telnet_mccp_start(unsigned char *out);
+size_t telnet_mccp_compress(struct telnet_mccp *mc, unsigned char *out, size_t out_max, size_t len, const char *text, size_t *consumed, int flush);
+int telnet_mccp_decompress(struct telnet_mccp *mc, unsigned char *out, size_t out_max, size_t len, const char *in, size_t *consumed, size_t *produced);
+#endif
+
+/* a broadcast message, escaped once and shared by reference */
+struct telnet_frame;
+struct telnet_frame *telnet_frame_create(size_t len, const char *text);
+struct telnet_frame *telnet_frame_ref(struct telnet_frame *f);
+void telnet_frame_unref(struct telnet_frame *f);
+size_t telnet_frame_len(const struct telnet_frame *f);
+#ifdef JDM_TELNET_MCCP
+int telnet_frame_compress(struct telnet_frame *f, int level);
+#endif
+
+/* per-connection output queue of chained segments */
+struct telnet_outq;
+struct telnet_outq *telnet_outq_create(size_t seg_size, size_t low_water, size_t high_water);
+void telnet_outq_free(struct telnet_outq *q);
+int telnet_outq_text(struct telnet_outq *q, size_t len, const char *text);
+int telnet_outq_raw(struct telnet_outq *q, size_t len, const void *data);
+int telnet_outq_frame(struct telnet_outq *q, struct telnet_frame *f);
+int telnet_outq_peek(struct telnet_outq *q, struct iovec *iov, int iov_max);
+void telnet_outq_consume(struct telnet_outq *q, size_t n);
+ssize_t telnet_outq_flush(struct telnet_outq *q, int fd);
+size_t telnet_outq_pending(const struct telnet_outq *q);
+int telnet_outq_throttled(const struct telnet_outq *q);
+void telnet_outq_discard(struct telnet_outq *q);
+#ifdef JDM_TELNET_MCCP
+void telnet_outq_setmccp(struct telnet_outq *q, struct telnet_mccp *mc);
+void telnet_outq_setmccp_shared(struct telnet_outq *q);
+int telnet_outq_mccp_end(struct telnet_outq *q);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #ifdef JDM_TELNET_IMPLEMENTATION
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef JDM_TELNET_TRACE
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #define TELCMDS
 #define TELOPTS
 
 #include <arpa/telnet.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 enum telnet_state {
     TelnetStateError,           /* some error occurred and we cannot proceed */
     TelnetStateText,
@@ -226,65 +533,543 @@ enum telnet_state {
     TelnetStateIacOption,       /* TELOPT_xxx */
     TelnetStateSb,              /* SB ... */
     TelnetStateSbIac,           /* IAC inside Sb */
+    TelnetStateMax
+};
+
+/* RFC 1143 state for one side of every option, one bit per option:
+ *   NO      yes=0 want=0
+ *   YES     yes=1 want=0
+ *   WANTNO  yes=1 want=1
+ *   WANTYES yes=0 want=1
+ * opp is the OPPOSITE queue bit. allow is set for options we agree to when
+ * the other end asks for them.
+ */
+struct telnet_qside {
+    unsigned char yes[32], want[32], opp[32], allow[32];
 };
 
 struct telnet_info {
     enum telnet_state telnet_state;
     const unsigned char *inbuf;
     size_t inbuf_len, inbuf_current;
+    const struct iovec *iov;    /* telnet_beginv(): inbuf is iov[iov_index] */
+    int iovcnt, iov_index;
+    int inplace;                /* inbuf is writable, collapse IAC IAC */
+    int flags;                  /* enum telnet_flags */
     unsigned char command, option;
+    unsigned char sb_chunk;     /* enum telnet_sbchunk of the last SB */
+    unsigned char sb_first;     /* no piece of the current SB returned yet */
+    unsigned char cr_pending;   /* TelnetFlagNewline: the last buffer ended in CR */
+    struct telnet_linebuf *linebuf; /* absorbs text when set */
+    unsigned char *extra;       /* extra_buf, or a heap buffer for TelnetFlagSbGrow */
     size_t extra_len;
-    size_t extra_max;
+    size_t extra_max;           /* size of extra */
+    size_t extra_inline;        /* size of extra_buf */
+    size_t sb_limit;
+    struct telnet_qside q_us, q_him;
+#ifdef JDM_TELNET_STATS
+    unsigned char sb_truncated; /* the current SB frame was counted as truncated */
+    struct telnet_stats stats;
+#endif
+#ifdef JDM_TELNET_TRACE
+    struct telnet_trace *trace; /* records input when set */
+    unsigned long trace_conn;
+#endif
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
-    unsigned char extra[];
+    unsigned char extra_buf[];
 #else
-    unsigned char extra[0]; /* hack to do flex arrays in C89 */
+    unsigned char extra_buf[0]; /* hack to do flex arrays in C89 */
 #endif
 };
 
-struct telnet_info *telnet_create(size_t extra_max) {
-    struct telnet_info *ret;
-    /* if extra_max is 0 pick a reasonable size */
-    if(!extra_max) extra_max=48;
-    ret=malloc(sizeof *ret + extra_max);
+/* if extra_max is 0 pick a reasonable size.
+ * streaming needs room for at least an escaped IAC.
+ */
+static size_t telnet_extra_size(size_t extra_max) {
+    return extra_max ? (extra_max < 2 ? 2 : extra_max) : 48;
+}
+
+/* number of bytes telnet_init() needs for a given extra_max */
+size_t telnet_sizeof(size_t extra_max) {
+    return sizeof(struct telnet_info) + telnet_extra_size(extra_max);
+}
+
+/* initialize a telnet state in caller provided memory of at least
+ * telnet_sizeof(extra_max) bytes, aligned for any type.
+ * release it with telnet_fini(), not telnet_free().
+ */
+struct telnet_info *telnet_init(void *mem, size_t extra_max) {
+    struct telnet_info *ret=mem;
+    if(!ret) return NULL;
     ret->telnet_state=TelnetStateText;
+    ret->extra=ret->extra_buf;
     ret->extra_len=0;
-    ret->extra_max=extra_max;
+    ret->extra_max=telnet_extra_size(extra_max);
+    ret->extra_inline=ret->extra_max;
+    ret->sb_limit=65536;
+    ret->sb_chunk=0;
+    ret->sb_first=0;
+    ret->cr_pending=0;
+    ret->linebuf=NULL;
+    ret->flags=0;
     ret->inbuf_len=0;
     ret->inbuf_current=0;
     ret->inbuf=NULL;
+    ret->inplace=0;
+    ret->iov=NULL;
+    ret->iovcnt=0;
+    ret->iov_index=0;
+    memset(&ret->q_us, 0, sizeof(ret->q_us));
+    memset(&ret->q_him, 0, sizeof(ret->q_him));
+#ifdef JDM_TELNET_STATS
+    ret->sb_truncated=0;
+    memset(&ret->stats, 0, sizeof(ret->stats));
+#endif
+#ifdef JDM_TELNET_TRACE
+    ret->trace=NULL;
+    ret->trace_conn=0;
+#endif
     return ret;
 }
 
-/* loads a buffer to the telnet engine */
-int telnet_begin(struct telnet_info *ts, size_t inbuf_len, const char *inbuf) {
+/* go back to the inline SB buffer */
+static void telnet_sb_release(struct telnet_info *ts) {
+    if(ts->extra!=ts->extra_buf) {
+        free(ts->extra);
+        ts->extra=ts->extra_buf;
+        ts->extra_max=ts->extra_inline;
+    }
+}
+
+/* releases anything held by a state from telnet_init(). the memory itself
+ * still belongs to the caller.
+ */
+void telnet_fini(struct telnet_info *ts) {
+    telnet_sb_release(ts);
+}
+
+struct telnet_info *telnet_create(size_t extra_max) {
+    return telnet_init(malloc(telnet_sizeof(extra_max)), extra_max);
+}
+
+/* set enum telnet_flags options.
+ * TelnetFlagSbStream - SB payloads longer than the SB buffer are returned
+ *   by telnet_getcontrol() in several pieces instead of being truncated.
+ *   telnet_sbchunk() tells the first and last piece apart.
+ * TelnetFlagSbGrow - SB payloads longer than extra_max are moved to a heap
+ *   buffer that doubles up to the telnet_setsblimit() size. the buffer is
+ *   only allocated when such a payload arrives and is released again by
+ *   telnet_end(), so extra_max can stay small.
+ * with both, payloads are streamed once the heap buffer is at its limit.
+ * TelnetFlagNewline - telnet_gettext() returns text with NVT line endings
+ *   normalized: CR LF becomes LF, CR NUL becomes CR, and a bare LF is kept.
+ *   this is done by the same scan that looks for IAC, also when the CR and
+ *   the byte after it arrive in different buffers. a CR that can only be
+ *   decided by the next buffer is returned as a one byte text of its own.
+ */
+void telnet_setflags(struct telnet_info *ts, int flags) {
+    ts->flags=flags;
+}
+
+int telnet_getflags(const struct telnet_info *ts) {
+    return ts->flags;
+}
+
+void telnet_setsblimit(struct telnet_info *ts, size_t limit) {
+    ts->sb_limit=limit;
+}
+
+/* returns the enum telnet_sbchunk bits of the last SB returned */
+int telnet_sbchunk(const struct telnet_info *ts) {
+    return ts->sb_chunk;
+}
+
+/* a plain increment, the state is only used by one thread at a time */
+#ifdef JDM_TELNET_STATS
+#define TELNET_COUNT(ts, counter, n) ((ts)->stats.counter+=(n))
+#else
+#define TELNET_COUNT(ts, counter, n) ((void)0)
+#endif
+
+#ifdef JDM_TELNET_STATS
+/* the counters of one state. read them between telnet_end() and the next
+ * telnet_begin(), from the thread that parses.
+ */
+const struct telnet_stats *telnet_getstats(const struct telnet_info *ts) {
+    assert(ts != NULL);
+    return &ts->stats;
+}
+
+void telnet_stats_add(struct telnet_stats *sum, const struct telnet_stats *s) {
+    unsigned i;
+
+    assert(sum != NULL);
+    assert(s != NULL);
+    sum->text_bytes+=s->text_bytes;
+    sum->sb_bytes+=s->sb_bytes;
+    sum->iac_escapes+=s->iac_escapes;
+    for(i=0;i<sizeof(s->commands)/sizeof(*s->commands);i++) {
+        sum->commands[i]+=s->commands[i];
+    }
+    for(i=0;i<sizeof(s->negotiations)/sizeof(*s->negotiations);i++) {
+        sum->negotiations[i]+=s->negotiations[i];
+    }
+    sum->sb_frames+=s->sb_frames;
+    sum->sb_truncated+=s->sb_truncated;
+    sum->unknown+=s->unknown;
+    sum->errors+=s->errors;
+#ifdef JDM_TELNET_STATS_OPTIONS
+    for(i=0;i<sizeof(s->options)/sizeof(*s->options);i++) {
+        sum->options[i]+=s->options[i];
+    }
+#endif
+}
+#endif
+
+#ifdef JDM_TELNET_TRACE
+struct telnet_trace {
+    int fd;
+};
+
+/* open filename for appending records, starting it if it is empty.
+ * one trace can be shared by states in several threads, the records of
+ * one read are a single write to an O_APPEND file.
+ */
+struct telnet_trace *telnet_trace_open(const char *filename) {
+    struct telnet_trace *tr=malloc(sizeof *tr);
+
+    if(!tr) return NULL;
+    tr->fd=open(filename, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if(tr->fd<0) {
+        free(tr);
+        return NULL;
+    }
+    if(lseek(tr->fd, 0, SEEK_END)==0 &&
+        write(tr->fd, TELNET_TRACE_MAGIC, 8)!=8) {
+        close(tr->fd);
+        free(tr);
+        return NULL;
+    }
+    return tr;
+}
+
+/* no state may still be using tr */
+void telnet_trace_close(struct telnet_trace *tr) {
+    if(!tr) return;
+    close(tr->fd);
+    free(tr);
+}
+
+#define TELNET_TRACE_BATCH 8
+
+static void telnet_trace_record(struct telnet_trace_record *rec, const struct timespec *now, unsigned long conn, unsigned flags, size_t len) {
+    rec->time_ns=(uint64_t)now->tv_sec*1000000000u+(uint64_t)now->tv_nsec;
+    rec->conn=(uint32_t)conn;
+    rec->flags=flags;
+    rec->len=(uint32_t)len;
+    rec->reserved=0;
+}
+
+/* append a record per buffer in a single write, so the records of one
+ * telnet_beginv() stay next to each other. more buffers than a batch are
+ * copied into one block first. returns 0 if the records were lost, input
+ * is never held up by the trace.
+ */
+static int telnet_trace_write(struct telnet_trace *tr, unsigned long conn, unsigned flags, const struct iovec *in, int count) {
+    struct telnet_trace_record rec[TELNET_TRACE_BATCH];
+    struct iovec iov[2*TELNET_TRACE_BATCH];
+    struct timespec now;
+    unsigned char *buf, *p;
+    size_t total;
+    int i, ok;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(count<=TELNET_TRACE_BATCH) {
+        for(i=0;i<count;i++) {
+            telnet_trace_record(&rec[i], &now, conn, flags|(i+1<count ? TelnetTraceMore : 0), in[i].iov_len);
+            iov[2*i].iov_base=&rec[i];
+            iov[2*i].iov_len=sizeof(*rec);
+            iov[2*i+1]=in[i];
+        }
+        return writev(tr->fd, iov, 2*count)>=0;
+    }
+    for(total=0, i=0;i<count;i++) total+=sizeof(*rec)+in[i].iov_len;
+    buf=malloc(total);
+    if(!buf) return 0;
+    for(p=buf, i=0;i<count;i++) {
+        telnet_trace_record(rec, &now, conn, flags|(i+1<count ? TelnetTraceMore : 0), in[i].iov_len);
+        memcpy(p, rec, sizeof(*rec));
+        p+=sizeof(*rec);
+        if(in[i].iov_len) memcpy(p, in[i].iov_base, in[i].iov_len);
+        p+=in[i].iov_len;
+    }
+    ok=write(tr->fd, buf, total)>=0;
+    free(buf);
+    return ok;
+}
+
+/* conn tells the connections in a trace apart, the replay starts a fresh
+ * state for it here. each traced buffer costs a system call, so trace a
+ * sample of connections rather than all of them.
+ */
+void telnet_settrace(struct telnet_info *ts, struct telnet_trace *tr, unsigned long conn) {
+    struct iovec none;
+
+    assert(ts != NULL);
+    ts->trace=tr;
+    ts->trace_conn=conn;
+    none.iov_base=NULL;
+    none.iov_len=0;
+    if(tr) telnet_trace_write(tr, conn, TelnetTraceStart, &none, 1);
+}
+#endif
+
+static void telnet_load(struct telnet_info *ts, size_t inbuf_len, const char *inbuf) {
     assert(ts != NULL);
     assert(ts->inbuf == NULL);
     ts->inbuf=(const unsigned char*)inbuf;
     ts->inbuf_len=inbuf_len;
     ts->inbuf_current=0;
+    ts->inplace=0;
+    ts->iov=NULL;
+    ts->iovcnt=0;
+    ts->iov_index=0;
+}
+
+/* loads a buffer to the telnet engine */
+int telnet_begin(struct telnet_info *ts, size_t inbuf_len, const char *inbuf) {
+    telnet_load(ts, inbuf_len, inbuf);
+#ifdef JDM_TELNET_TRACE
+    if(ts->trace) {
+        struct iovec iov;
+        iov.iov_base=(void*)inbuf;
+        iov.iov_len=inbuf_len;
+        telnet_trace_write(ts->trace, ts->trace_conn, 0, &iov, 1);
+    }
+#endif
+    return 1;
+}
+
+/* loads a list of buffers to the telnet engine. they are parsed as one
+ * stream: commands, SB payloads and CR LF may straddle two buffers, text
+ * is returned in one span per buffer and points into that buffer.
+ */
+int telnet_beginv(struct telnet_info *ts, const struct iovec *iov, int iovcnt) {
+    assert(iov != NULL || iovcnt <= 0);
+    if(iovcnt<=0) return telnet_begin(ts, 0, "");
+    telnet_load(ts, iov[0].iov_len, iov[0].iov_base);
+    ts->iov=iov;
+    ts->iovcnt=iovcnt;
+#ifdef JDM_TELNET_TRACE
+    if(ts->trace) telnet_trace_write(ts->trace, ts->trace_conn, 0, iov, iovcnt);
+#endif
+    return 1;
+}
+
+/* which iovec of telnet_beginv() is being parsed */
+int telnet_segment(const struct telnet_info *ts) {
+    return ts->iov_index;
+}
+
+/* move to the next iovec with data once the current one is parsed.
+ * returns true if there is something left to parse.
+ */
+static int telnet_nextseg(struct telnet_info *ts) {
+    while(ts->inbuf_current>=ts->inbuf_len && ts->iov_index+1<ts->iovcnt) {
+        ts->iov_index++;
+        ts->inbuf=(const unsigned char*)ts->iov[ts->iov_index].iov_base;
+        ts->inbuf_len=ts->iov[ts->iov_index].iov_len;
+        ts->inbuf_current=0;
+    }
+    return ts->inbuf_current<ts->inbuf_len;
+}
+
+/* loads a writable buffer to the telnet engine.
+ * text with IAC IAC escapes is compacted in place so that telnet_gettext()
+ * returns the longest possible runs instead of splitting at every 0xFF.
+ * the contents of inbuf are undefined after telnet_end().
+ */
+int telnet_begin_inplace(struct telnet_info *ts, size_t inbuf_len, char *inbuf) {
+    telnet_begin(ts, inbuf_len, inbuf);
+    ts->inplace=1;
     return 1;
 }
 
-#ifdef JDM_TELNET_DEBUG
-static void hexdump(int n, const unsigned char *d) {
-    int i;
-    for(i=0;i<n;i++) fprintf(stderr, " %02X", d[i]);
+/* the IAC-only callers rely on inlining to drop the second compare */
+#if defined(__GNUC__)
+#define TELNET_INLINE __inline__ __attribute__((always_inline))
+#else
+#define TELNET_INLINE
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/* index of the lowest set bit. mask must be non-zero. */
+static unsigned telnet_ctz(unsigned long mask) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzl(mask);
+#else
+    unsigned n=0;
+    while(!(mask&1)) {
+        mask>>=1;
+        n++;
+    }
+    return n;
+#endif
 }
 #endif
 
+/* find the first byte in p[0..n) that is c1 or c2.
+ * returns its offset, or n if there is none.
+ * the vector width is picked at compile time: AVX2, SSE2, or a portable
+ * SWAR loop that checks one machine word at a time. with c1==c2 the second
+ * compare is the same expression and is folded away.
+ */
+static TELNET_INLINE size_t telnet_scan2(const unsigned char *p, size_t n, unsigned char c1, unsigned char c2) {
+    size_t i=0;
+#if defined(__AVX2__)
+    const __m256i v1=_mm256_set1_epi8((char)c1), v2=_mm256_set1_epi8((char)c2);
+    /* 64 bytes per iteration, the common case for bulk text */
+    for(;i+64<=n;i+=64) {
+        __m256i a=_mm256_loadu_si256((const __m256i*)(p+i));
+        __m256i b=_mm256_loadu_si256((const __m256i*)(p+i+32));
+        unsigned long ma=(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, v1), _mm256_cmpeq_epi8(a, v2)));
+        unsigned long mb=(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, v1), _mm256_cmpeq_epi8(b, v2)));
+        if(ma) return i+telnet_ctz(ma);
+        if(mb) return i+32+telnet_ctz(mb);
+    }
+    for(;i+32<=n;i+=32) {
+        __m256i a=_mm256_loadu_si256((const __m256i*)(p+i));
+        unsigned long m=(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, v1), _mm256_cmpeq_epi8(a, v2)));
+        if(m) return i+telnet_ctz(m);
+    }
+#elif defined(__SSE2__)
+    const __m128i v1=_mm_set1_epi8((char)c1), v2=_mm_set1_epi8((char)c2);
+    /* 64 bytes per iteration, the common case for bulk text */
+    for(;i+64<=n;i+=64) {
+        __m128i a=_mm_loadu_si128((const __m128i*)(p+i));
+        __m128i b=_mm_loadu_si128((const __m128i*)(p+i+16));
+        __m128i c=_mm_loadu_si128((const __m128i*)(p+i+32));
+        __m128i d=_mm_loadu_si128((const __m128i*)(p+i+48));
+        a=_mm_or_si128(_mm_cmpeq_epi8(a, v1), _mm_cmpeq_epi8(a, v2));
+        b=_mm_or_si128(_mm_cmpeq_epi8(b, v1), _mm_cmpeq_epi8(b, v2));
+        c=_mm_or_si128(_mm_cmpeq_epi8(c, v1), _mm_cmpeq_epi8(c, v2));
+        d=_mm_or_si128(_mm_cmpeq_epi8(d, v1), _mm_cmpeq_epi8(d, v2));
+        if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+            break; /* the 16 byte loop finds the exact position */
+    }
+    for(;i+16<=n;i+=16) {
+        __m128i a=_mm_loadu_si128((const __m128i*)(p+i));
+        unsigned long m=(unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, v1), _mm_cmpeq_epi8(a, v2)));
+        if(m) return i+telnet_ctz(m);
+    }
+#else
+    /* SWAR: a byte matches when it is zero after xor with the pattern */
+    const size_t ones=(size_t)-1/0xff, highs=ones*0x80;
+    const size_t w1=ones*c1, w2=ones*c2;
+    for(;i+sizeof(size_t)<=n;i+=sizeof(size_t)) {
+        size_t w, x, y;
+        memcpy(&w, p+i, sizeof w);
+        x=w^w1;
+        y=w^w2;
+        if(((x-ones) & ~x & highs) | ((y-ones) & ~y & highs)) break; /* the tail loop finds the byte */
+    }
+#endif
+    for(;i<n;i++) {
+        if(p[i]==c1 || p[i]==c2) return i;
+    }
+    return n;
+}
+
+/* find the first IAC in p[0..n).
+ * returns the offset of the IAC, or n if there is none.
+ */
+static size_t telnet_scan_iac(const unsigned char *p, size_t n) {
+    return telnet_scan2(p, n, IAC, IAC);
+}
+
+/* scan text from current, collapsing each IAC IAC into one IAC by moving
+ * the following text down over the consumed escape. only bytes that were
+ * already consumed are overwritten. out is the write position.
+ * with TelnetFlagNewline CR LF and CR NUL are collapsed the same way.
+ * returns the read position: the end of the buffer or an unescaped IAC.
+ */
+static size_t telnet_unescape(struct telnet_info *ts, size_t current, size_t *out) {
+    unsigned char *buf=(unsigned char*)ts->inbuf;
+    unsigned char c2=(ts->flags&TelnetFlagNewline) ? '\r' : IAC;
+    size_t n, dst=*out;
+
+    for(;;) {
+        n=telnet_scan2(buf+current, ts->inbuf_len-current, IAC, c2);
+        if(dst!=current) memmove(buf+dst, buf+current, n);
+        dst+=n;
+        current+=n;
+        if(current<ts->inbuf_len && buf[current]=='\r') {
+            if(current+1>=ts->inbuf_len) {
+                /* decided by the next buffer */
+                ts->cr_pending=1;
+                current++;
+                break;
+            }
+            /* CR LF keeps the LF, CR NUL the CR, anything else both */
+            if(buf[current+1]!='\n') buf[dst++]='\r';
+            current+=buf[current+1]=='\0' ? 2 : 1;
+            continue;
+        }
+        if(current+1>=ts->inbuf_len || buf[current+1]!=IAC) break;
+        /* IAC IAC, keep one */
+        TELNET_COUNT(ts, iac_escapes, 1);
+        buf[dst++]=IAC;
+        current+=2;
+    }
+    *out=dst;
+    return current;
+}
+
+/* scan text from current for TelnetFlagNewline without modifying it.
+ * CR LF ends the text before the CR and CR NUL after it, and the next text
+ * starts past whatever was dropped. *end is the end of the text.
+ * returns the read position.
+ */
+static size_t telnet_newline_scan(struct telnet_info *ts, size_t current, size_t *end) {
+    const unsigned char *p=ts->inbuf;
+    size_t len=ts->inbuf_len;
+
+    for(;;) {
+        current+=telnet_scan2(p+current, len-current, IAC, '\r');
+        if(current>=len || p[current]==IAC) {
+            *end=current;
+            return current;
+        }
+        if(current+1>=len) {
+            /* decided by the next buffer */
+            ts->cr_pending=1;
+            *end=current;
+            return current+1;
+        }
+        if(p[current+1]=='\n') {
+            *end=current;
+            return current+1;
+        }
+        if(p[current+1]=='\0') {
+            *end=current+1;
+            return current+2;
+        }
+        current++; /* a CR before anything else is kept */
+    }
+}
+
+/* text for a CR held over from the previous buffer */
+static const char telnet_cr[]="\r";
+
 /* get the next block of regular text from the telnet engine
  * for IAC IAC the call will be broken up into two parts.
  * this is because the input buffer is not modified.
+ * (buffers loaded with telnet_begin_inplace() are modified instead, and only
+ * an IAC IAC split across two buffers is returned in two parts.)
  */
-int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr) {
+static int telnet_text(struct telnet_info *ts, size_t *len, const char **ptr) {
     size_t current, newlen;
 
-    assert(ts != NULL);
-    assert(ts->inbuf != NULL);
-    assert(ptr != NULL);
-    assert(len != NULL);
-
     if(ts->telnet_state == TelnetStateError || (ts->inbuf_current >= ts->inbuf_len)) {
         /* no more data */
         return 0;
@@ -295,6 +1080,17 @@ int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr) {
             return 0;
         case TelnetStateIacIac:
         case TelnetStateText:
+            if(ts->cr_pending) {
+                /* the buffer before ended in CR, this one decides what it was */
+                ts->cr_pending=0;
+                if(ts->inbuf[ts->inbuf_current]!='\n') {
+                    if(ts->inbuf[ts->inbuf_current]=='\0') ts->inbuf_current++;
+                    TELNET_COUNT(ts, text_bytes, 1);
+                    *ptr=telnet_cr;
+                    *len=1;
+                    return 1;
+                }
+            }
             *ptr=(const char*)ts->inbuf+ts->inbuf_current;
             current=ts->inbuf_current;
             newlen=0;
@@ -304,23 +1100,25 @@ int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr) {
                 current++;
                 newlen++;
             }
-            for(;current<ts->inbuf_len;current++,newlen++) {
-                    if(ts->inbuf[current]==IAC) {
-                        ts->telnet_state=TelnetStateIacCommand;
-#ifdef JDM_TELNET_DEBUG
-                        fprintf(stderr, "command: ");
-                        hexdump(8, &ts->inbuf[current]);
-                        fprintf(stderr, "\n");
-#endif
-                        current++;
-                        break;
-                    }
+            if(ts->inplace) {
+                size_t out=current;
+                current=telnet_unescape(ts, current, &out);
+                newlen=out-ts->inbuf_current;
+            } else if(ts->flags&TelnetFlagNewline) {
+                size_t end;
+                current=telnet_newline_scan(ts, current, &end);
+                newlen=end-ts->inbuf_current;
+            } else {
+                size_t n=telnet_scan_iac(ts->inbuf+current, ts->inbuf_len-current);
+                current+=n;
+                newlen+=n;
             }
-#ifdef JDM_TELNET_DEBUG
-            fprintf(stderr, "curr: %d len: %d inbuf: %d %d\n",
-                        (int)current, (int)newlen,
-                        (int)ts->inbuf_current, (int)ts->inbuf_len);
-#endif
+            if(current<ts->inbuf_len && ts->inbuf[current]==IAC) {
+                /* found IAC */
+                ts->telnet_state=TelnetStateIacCommand;
+                current++;
+            }
+            TELNET_COUNT(ts, text_bytes, newlen);
             *len=newlen;
             ts->inbuf_current=current;
             return 1;
@@ -328,192 +1126,620 @@ int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr) {
         case TelnetStateIacOption:
         case TelnetStateSb:
         case TelnetStateSbIac:
+        case TelnetStateMax:
             return 0;
     }
     fprintf(stderr, "Invalid telnet state %d in %p\n", ts->telnet_state, (void*)ts);
     ts->telnet_state=TelnetStateError;
+    TELNET_COUNT(ts, errors, 1);
     return 0;
 }
 
-/* get the next control item from the telnet engine.
- * ts - telnet info/state
- * command - pointer to a single unsigned char
- * option - pointerto a single unsigned char
- * extra_len - pointer to write the length of the extra data
- * extra - extra data buffer (for SB)
+/* positions in the ring count up forever and are masked on access.
+ * [head, line) are complete lines, each ended by a '\n'.
+ * [line, tail) is the line being typed.
  */
-int telnet_getcontrol(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
-    unsigned char tmp;
+struct telnet_linebuf {
+    size_t mask;                /* capacity-1 */
+    size_t head, line, tail;
+    size_t dropped;             /* bytes lost because the ring was full */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+    char ring[];
+#else
+    char ring[0]; /* hack to do flex arrays in C89 */
+#endif
+};
 
-    assert(ts != NULL);
-    assert(ts->inbuf != NULL);
-    assert(command != NULL);
-    assert(option != NULL);
+/* capacity is rounded up to a power of 2 */
+static size_t telnet_linebuf_capacity(size_t capacity) {
+    size_t n=16;
+    while(n<capacity) n*=2;
+    return n;
+}
 
-again:
-    if(ts->telnet_state == TelnetStateError || (ts->inbuf_current >= ts->inbuf_len)) {
-        /* no more data */
-        return 0;
-    }
+/* number of bytes telnet_linebuf_init() needs for a given capacity */
+size_t telnet_linebuf_sizeof(size_t capacity) {
+    return sizeof(struct telnet_linebuf) + telnet_linebuf_capacity(capacity);
+}
 
-    switch(ts->telnet_state) {
-        case TelnetStateError:
-            return 0;
-        case TelnetStateIacCommand:
-            /* look for command parameter to IAC */
-            tmp=(unsigned char)ts->inbuf[ts->inbuf_current];
-#ifdef JDM_TELNET_DEBUG
-            fprintf(stderr, "IAC %s\n", TELCMD(tmp));
-#endif
-            switch(tmp) {
-                case IAC:
-                    ts->telnet_state=TelnetStateIacIac;
-                    return 0;
-                case DONT:
-                case DO:
-                case WONT:
-                case WILL:
-                    /* the following is for 3-byte IAC <cmd> <opt> codes */
-                    ts->telnet_state=TelnetStateIacOption;
-                    ts->command=tmp;
-                    ts->inbuf_current++;
-                    goto again;
-                case EOR: /* End of Record - RFC 885 */
-                    /* This only shows up if TELOPT_EOR was negotiated */
-                case ABORT: /* Abort - RFC 1184 */
-                    /* This only shows up if TELOPT_LINEMODE was negotiated */
-                    /* should be treated the same as IAC IP in most cases */
-                case SUSP: /* Suspend - RFC 1184 */
-                    /* This only shows up if TELOPT_LINEMODE was negotiated */
-                case xEOF: /* End of File - RFC 1184 */
-                    /* This only shows up if TELOPT_LINEMODE was negotiated */
-                    /* user sent an EOF "character"/signal */
-                case EC: /* Erase Character */
-                case EL: /* Erase Line */
-                case GA: /* Go Ahead */
-                case AYT: /* Are You There */
-                case AO: /* Abort Output */
-                case IP: /* Interrupt Process */
-                case NOP: /* No Operations */
-                case BREAK: /* special key with a vague definition - RFC 854 */
-                    /* the following is for 2-byte IAC <cmd> codes */
-                    ts->command=tmp;
-                    ts->inbuf_current++;
-                    ts->telnet_state=TelnetStateText; /* go back to text */
-                    ts->option=0;
-                    if(command) *command=ts->command;
-                    if(option) *option=0;
-                    if(extra_len) *extra_len=0;
-                    if(extra) *extra=0;
-                    return 1;
-                case DM: /* data mark */
-                    /* marks the location in the stream a high priority
-                     * telnet urgant OOB message was sent.
-                     * normally all unprocessed data is discarded from the
-                     * point of the urgant message to the DM.
-                     * if an IAC DM is received but no urgant messages are
-                     * pending then the DM is ignored (treated as an IAC NOP)
-                     */
-                    /* the following is for 2-byte IAC <cmd> codes */
-                    ts->command=tmp;
-                    ts->inbuf_current++;
-                    ts->telnet_state=TelnetStateText; /* go back to text */
-                    ts->option=0;
-                    if(command) *command=ts->command;
-                    if(option) *option=0;
-                    if(extra_len) *extra_len=0;
-                    if(extra) *extra=0;
-                    return 1;
-                case SB: /* Subnegotiation Begin */
-                    /* format: IAC SB <option> ... IAC SE */
-                    ts->command=SB;
-                    ts->telnet_state=TelnetStateSb;
-                    ts->extra_len=0;
-                    ts->inbuf_current++;
-                    goto again;
-                case SE: /* Subnegotiation End */
-                    /* this is an error in this state. we ignore it */
-                    ts->telnet_state=TelnetStateText;
-                    ts->inbuf_current++; /* swallow the sequence code */
-#ifdef JDM_TELNET_DEBUG
-                    fprintf(stderr, "Found IAC SE in outside of SB stream, ignoring it.\n");
-#endif
-                    goto again;
-                default: /* treat anything we don't know as a 2 byte code */
-                    /* the following is for 2-byte IAC <cmd> codes */
-#ifdef JDM_TELNET_DEBUG
-                    fprintf(stderr, "unknown code %u\n", tmp);
-#endif
-                    ts->command=tmp;
-                    ts->inbuf_current++;
-                    ts->telnet_state=TelnetStateText; /* go back to text */
-                    ts->option=0;
-                    if(command) *command=ts->command;
-                    if(option) *option=0;
-                    if(extra_len) *extra_len=0;
-                    if(extra) *extra=0;
-                    return 1;
-            }
-        case TelnetStateIacOption:
-            /* the following is for 3-byte IAC <cmd> <opt> codes */
-            ts->telnet_state=TelnetStateText;
-            ts->option=ts->inbuf[ts->inbuf_current++];
-            if(command) *command=ts->command;
-            if(option) *option=ts->option;
-            if(extra_len) *extra_len=0;
-            if(extra) *extra=0;
-            return 1;
-        case TelnetStateSb:
-            tmp=(unsigned char)ts->inbuf[ts->inbuf_current++];
-            if(tmp==IAC) {
-                /* found IAC */
-                ts->telnet_state=TelnetStateSbIac;
-            } else {
-                /* append data to buffer */
-                if(ts->extra_len < ts->extra_max) {
-                    ts->extra[ts->extra_len++]=tmp;
-                }
-            }
-            goto again;
-        case TelnetStateSbIac:
-            /* TODO: look for IAC SE */
-            tmp=(unsigned char)ts->inbuf[ts->inbuf_current++];
-            if(tmp==IAC) {
-                /* IAC IAC escape in SB sequence */
-                if(ts->extra_len < ts->extra_max) {
-                    ts->extra[ts->extra_len++]=tmp;
-                }
-            } else if(tmp==SE) {
-                /* IAC SE terminating SB sequence */
-                ts->telnet_state=TelnetStateText;
-                if(command) *command=ts->command;
-                if(option) *option=ts->extra[0];
-                if(extra_len) *extra_len=ts->extra_len;
-                if(extra) *extra=ts->extra;
-                return 1;
-            } else {
-                /* something unknown. don't escape anything */
-                if(ts->extra_len < ts->extra_max) {
-                    ts->extra[ts->extra_len++]=IAC;
-                }
-                if(ts->extra_len < ts->extra_max) {
-                    ts->extra[ts->extra_len++]=tmp;
-                }
-            }
-            goto again;
-        case TelnetStateIacIac:
-        case TelnetStateText:
-            /* nothing to get */
-            return 0;
-    }
-    fprintf(stderr, "Invalid telnet state %d in %p\n", ts->telnet_state, (void*)ts);
-    ts->telnet_state=TelnetStateError;
-    return 0;
+/* initialize a line ring in caller provided memory of at least
+ * telnet_linebuf_sizeof(capacity) bytes. it holds nothing to release.
+ */
+struct telnet_linebuf *telnet_linebuf_init(void *mem, size_t capacity) {
+    struct telnet_linebuf *lb=mem;
+    if(!lb) return NULL;
+    lb->mask=telnet_linebuf_capacity(capacity)-1;
+    lb->head=lb->line=lb->tail=0;
+    lb->dropped=0;
+    return lb;
+}
+
+struct telnet_linebuf *telnet_linebuf_create(size_t capacity) {
+    return telnet_linebuf_init(malloc(telnet_linebuf_sizeof(capacity)), capacity);
+}
+
+void telnet_linebuf_free(struct telnet_linebuf *lb) {
+    free(lb);
+}
+
+/* attach a line ring to a state, or detach it with NULL.
+ * while attached, text is not returned by telnet_gettext() or
+ * telnet_parse_batch() but goes to the ring, and EC and EL are applied to
+ * it instead of being returned by telnet_getcontrol(). BS and DEL erase a
+ * character the same as EC, for clients that edit in character mode.
+ * TelnetFlagNewline is turned on, and LF or a lone CR ends a line.
+ * a ring must not be attached to more than one state.
+ */
+void telnet_setlinebuf(struct telnet_info *ts, struct telnet_linebuf *lb) {
+    ts->linebuf=lb;
+    if(lb) ts->flags|=TelnetFlagNewline;
+}
+
+/* copy a run of plain text to the end of the line being typed */
+static void telnet_linebuf_copy(struct telnet_linebuf *lb, size_t n, const char *p) {
+    size_t room=lb->mask+1-(lb->tail-lb->head);
+    size_t pos, first;
+
+    if(n>room) {
+        lb->dropped+=n-room;
+        n=room;
+    }
+    pos=lb->tail&lb->mask;
+    first=lb->mask+1-pos;
+    if(first>n) first=n;
+    memcpy(lb->ring+pos, p, first);
+    memcpy(lb->ring, p+first, n-first);
+    lb->tail+=n;
+}
+
+/* end the line being typed */
+static void telnet_linebuf_eol(struct telnet_linebuf *lb) {
+    if(lb->tail-lb->head>lb->mask) {
+        /* full: the line loses its last byte to the terminator */
+        if(lb->tail==lb->line) {
+            lb->dropped++;
+            return;
+        }
+        lb->tail--;
+        lb->dropped++;
+    }
+    lb->ring[lb->tail&lb->mask]='\n';
+    lb->tail++;
+    lb->line=lb->tail;
+}
+
+/* EC */
+static void telnet_linebuf_erase(struct telnet_linebuf *lb) {
+    if(lb->tail>lb->line) lb->tail--;
+}
+
+/* EL */
+static void telnet_linebuf_kill(struct telnet_linebuf *lb) {
+    lb->tail=lb->line;
+}
+
+/* absorb normalized text */
+static void telnet_linebuf_put(struct telnet_linebuf *lb, size_t len, const char *text) {
+    size_t i=0, run;
+    char c;
+
+    while(i<len) {
+        for(run=i;run<len;run++) {
+            c=text[run];
+            if(c=='\n' || c=='\r' || c=='\b' || c==127) break;
+        }
+        if(run>i) telnet_linebuf_copy(lb, run-i, text+i);
+        if(run>=len) break;
+        if(text[run]=='\n' || text[run]=='\r') {
+            telnet_linebuf_eol(lb);
+        } else {
+            telnet_linebuf_erase(lb);
+        }
+        i=run+1;
+    }
+}
+
+/* take up to max_lines complete lines, oldest first, without their
+ * terminator. the slices point into the ring and stay valid until the next
+ * telnet_begin() of the state the ring is attached to.
+ * returns the number of lines.
+ */
+int telnet_linebuf_get(struct telnet_linebuf *lb, struct telnet_line *lines, int max_lines) {
+    const char *nl;
+    size_t pos, avail, first;
+    int n=0;
+
+    assert(lb != NULL);
+    assert(lines != NULL || max_lines <= 0);
+    while(n<max_lines && lb->head!=lb->line) {
+        pos=lb->head&lb->mask;
+        avail=lb->line-lb->head;
+        first=lb->mask+1-pos;
+        if(first>avail) first=avail;
+        lines[n].text[0]=lb->ring+pos;
+        nl=memchr(lb->ring+pos, '\n', first);
+        if(nl) {
+            lines[n].len[0]=nl-(lb->ring+pos);
+            lines[n].text[1]=NULL;
+            lines[n].len[1]=0;
+            lb->head+=lines[n].len[0]+1;
+        } else {
+            /* wraps, the terminator is in the second part */
+            nl=memchr(lb->ring, '\n', avail-first);
+            assert(nl != NULL);
+            lines[n].len[0]=first;
+            lines[n].text[1]=lb->ring;
+            lines[n].len[1]=nl-lb->ring;
+            lb->head+=first+lines[n].len[1]+1;
+        }
+        n++;
+    }
+    return n;
+}
+
+/* bytes dropped so far because lines were not taken fast enough, or a line
+ * was longer than the ring
+ */
+size_t telnet_linebuf_dropped(const struct telnet_linebuf *lb) {
+    return lb->dropped;
+}
+
+/* make room for need bytes of SB payload on the heap.
+ * returns 0 when the limit is reached or memory is out.
+ */
+static int telnet_sb_grow(struct telnet_info *ts, size_t need) {
+    size_t cap=ts->extra_max;
+    unsigned char *p;
+
+    while(cap<need && cap<ts->sb_limit) cap*=2;
+    if(cap>ts->sb_limit) cap=ts->sb_limit;
+    if(cap<=ts->extra_max) return 0;
+    if(ts->extra==ts->extra_buf) {
+        p=malloc(cap);
+        if(p) memcpy(p, ts->extra, ts->extra_len);
+    } else {
+        p=realloc(ts->extra, cap);
+    }
+    if(!p) return 0;
+    ts->extra=p;
+    ts->extra_max=cap;
+    return 1;
+}
+
+/* append SB payload.
+ * returns how much of p was taken. less than n means the buffer is full and
+ * TelnetFlagSbStream wants it returned before taking more. otherwise the
+ * part that does not fit is dropped.
+ */
+static size_t telnet_sb_append(struct telnet_info *ts, const unsigned char *p, size_t n) {
+    size_t room=ts->extra_max-ts->extra_len;
+
+    if(n>room && (ts->flags&TelnetFlagSbGrow) && telnet_sb_grow(ts, ts->extra_len+n)) {
+        room=ts->extra_max-ts->extra_len;
+    }
+    if(n>room) {
+        memcpy(ts->extra+ts->extra_len, p, room);
+        ts->extra_len+=room;
+#ifdef JDM_TELNET_STATS
+        if(!(ts->flags&TelnetFlagSbStream) && !ts->sb_truncated) {
+            ts->sb_truncated=1;
+            ts->stats.sb_truncated++;
+        }
+#endif
+        return (ts->flags&TelnetFlagSbStream) ? room : n;
+    }
+    memcpy(ts->extra+ts->extra_len, p, n);
+    ts->extra_len+=n;
+    return n;
+}
+
+/* return the collected SB payload, or the next piece of it */
+static int telnet_sb_emit(struct telnet_info *ts, int last, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
+    if(ts->sb_first) {
+        ts->option=ts->extra_len ? ts->extra[0] : 0;
+    }
+    ts->sb_chunk=(ts->sb_first ? TelnetSbBegin : 0) | (last ? TelnetSbEnd : 0);
+    ts->sb_first=0;
+    if(command) *command=ts->command;
+    if(option) *option=ts->option;
+    if(extra_len) *extra_len=ts->extra_len;
+    if(extra) *extra=ts->extra;
+    TELNET_COUNT(ts, sb_bytes, ts->extra_len);
+    TELNET_COUNT(ts, sb_frames, last);
+    /* the next piece starts over at the beginning of the buffer */
+    ts->extra_len=0;
+    return 1;
+}
+
+/* called right after IAC SB. if the whole frame is in the current buffer
+ * and has no IAC IAC escapes, return it as a pointer into inbuf instead of
+ * copying it to extra.
+ */
+static int telnet_sb_direct(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
+    const unsigned char *p=ts->inbuf+ts->inbuf_current;
+    size_t left=ts->inbuf_len-ts->inbuf_current;
+    size_t n=telnet_scan_iac(p, left);
+
+    if(n+1>=left || p[n+1]!=SE) return 0;
+    ts->inbuf_current+=n+2;
+    ts->telnet_state=TelnetStateText;
+    ts->option=n ? p[0] : 0;
+    ts->sb_chunk=TelnetSbBegin|TelnetSbEnd;
+    ts->sb_first=0;
+    if(command) *command=SB;
+    if(option) *option=ts->option;
+    if(extra_len) *extra_len=n;
+    if(extra) *extra=p;
+    TELNET_COUNT(ts, sb_bytes, n);
+    TELNET_COUNT(ts, sb_frames, 1);
+    return 1;
+}
+
+/* byte classes for the control state machine */
+enum telnet_class {
+    TelnetClassData,            /* plain data, or a command we do not know */
+    TelnetClassCmd,             /* 2-byte IAC <cmd> */
+    TelnetClassNeg,             /* WILL WONT DO DONT */
+    TelnetClassSb,
+    TelnetClassSe,
+    TelnetClassIac,
+    TelnetClassMax
+};
+
+/* 2-byte commands:
+ * xEOF - End of File - RFC 1184. user sent an EOF "character"/signal
+ * SUSP - Suspend - RFC 1184
+ * ABORT - Abort - RFC 1184. should be treated the same as IAC IP in most cases
+ * EOR - End of Record - RFC 885. only if TELOPT_EOR was negotiated
+ *   (the RFC 1184 codes only show up if TELOPT_LINEMODE was negotiated)
+ * NOP - No Operations
+ * DM - data mark
+ *   marks the location in the stream a high priority
+ *   telnet urgant OOB message was sent.
+ *   normally all unprocessed data is discarded from the
+ *   point of the urgant message to the DM.
+ *   if an IAC DM is received but no urgant messages are
+ *   pending then the DM is ignored (treated as an IAC NOP)
+ * BREAK - special key with a vague definition - RFC 854
+ * IP - Interrupt Process
+ * AO - Abort Output
+ * AYT - Are You There
+ * EC - Erase Character
+ * EL - Erase Line
+ * GA - Go Ahead
+ */
+#define TELNET_C16(c) c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c
+#define TELNET_D TelnetClassData
+#define TELNET_C TelnetClassCmd
+#define TELNET_N TelnetClassNeg
+static const unsigned char telnet_byteclass[256]={
+    /* 0 - 223 */
+    TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D),
+    TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D),
+    TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D), TELNET_C16(TELNET_D),
+    TELNET_C16(TELNET_D), TELNET_C16(TELNET_D),
+    /* 224 - 235 */
+    TELNET_D, TELNET_D, TELNET_D, TELNET_D, TELNET_D, TELNET_D,
+    TELNET_D, TELNET_D, TELNET_D, TELNET_D, TELNET_D, TELNET_D,
+    /* xEOF SUSP ABORT EOR */
+    TELNET_C, TELNET_C, TELNET_C, TELNET_C,
+    /* SE */
+    TelnetClassSe,
+    /* NOP DM BREAK IP AO AYT EC EL GA */
+    TELNET_C, TELNET_C, TELNET_C, TELNET_C, TELNET_C, TELNET_C, TELNET_C, TELNET_C, TELNET_C,
+    /* SB */
+    TelnetClassSb,
+    /* WILL WONT DO DONT */
+    TELNET_N, TELNET_N, TELNET_N, TELNET_N,
+    /* IAC */
+    TelnetClassIac,
+};
+#undef TELNET_D
+#undef TELNET_C
+#undef TELNET_N
+#undef TELNET_C16
+
+/* what telnet_control() does for a state and byte class */
+enum telnet_action {
+    TelnetActNone,              /* nothing to get */
+    TelnetActIacIac,            /* IAC IAC, leave it for telnet_gettext() */
+    TelnetActNegotiate,         /* WILL WONT DO DONT, the option follows */
+    TelnetActCommand,           /* 2-byte IAC <cmd> */
+    TelnetActUnknown,           /* treat anything we don't know as a 2 byte code */
+    TelnetActSbBegin,           /* IAC SB */
+    TelnetActSeStray,           /* IAC SE outside of SB, ignored */
+    TelnetActOption,            /* option of a 3-byte IAC <cmd> <opt> */
+    TelnetActSbData,            /* SB payload up to the next IAC */
+    TelnetActSbIac,             /* IAC inside SB */
+    TelnetActSbEscape,          /* IAC IAC inside SB */
+    TelnetActSbEnd,             /* IAC SE */
+    TelnetActSbOther,           /* IAC <other> inside SB, kept unescaped */
+};
+
+/* transitions, indexed by state and byte class: next state in the high
+ * nibble, action in the low nibble. telnet_control() moves to the next
+ * state before running the action.
+ */
+#define TELNET_T(next, act) (unsigned char)((TelnetState##next<<4)|TelnetAct##act)
+static const unsigned char telnet_dfa[TelnetStateMax][TelnetClassMax]={
+    /*               Data                    Cmd                     Neg                        Sb                      Se                       Iac */
+    /* Error */    { TELNET_T(Error, None),  TELNET_T(Error, None),  TELNET_T(Error, None),     TELNET_T(Error, None),  TELNET_T(Error, None),   TELNET_T(Error, None) },
+    /* Text */     { TELNET_T(Text, None),   TELNET_T(Text, None),   TELNET_T(Text, None),      TELNET_T(Text, None),   TELNET_T(Text, None),    TELNET_T(Text, None) },
+    /* IacIac */   { TELNET_T(IacIac, None), TELNET_T(IacIac, None), TELNET_T(IacIac, None),    TELNET_T(IacIac, None), TELNET_T(IacIac, None),  TELNET_T(IacIac, None) },
+    /* IacCommand */
+                   { TELNET_T(Text, Unknown), TELNET_T(Text, Command), TELNET_T(IacOption, Negotiate), TELNET_T(Sb, SbBegin), TELNET_T(Text, SeStray), TELNET_T(IacIac, IacIac) },
+    /* IacOption */{ TELNET_T(Text, Option), TELNET_T(Text, Option), TELNET_T(Text, Option),    TELNET_T(Text, Option), TELNET_T(Text, Option),  TELNET_T(Text, Option) },
+    /* Sb */       { TELNET_T(Sb, SbData),   TELNET_T(Sb, SbData),   TELNET_T(Sb, SbData),      TELNET_T(Sb, SbData),   TELNET_T(Sb, SbData),    TELNET_T(SbIac, SbIac) },
+    /* SbIac */    { TELNET_T(Sb, SbOther),  TELNET_T(Sb, SbOther),  TELNET_T(Sb, SbOther),     TELNET_T(Sb, SbOther),  TELNET_T(Text, SbEnd),   TELNET_T(Sb, SbEscape) },
+};
+#undef TELNET_T
+
+/* hand a 2 or 3 byte command to the caller */
+static int telnet_emit(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
+    if(command) *command=ts->command;
+    if(option) *option=ts->option;
+    if(extra_len) *extra_len=0;
+    if(extra) *extra=0;
+    return 1;
+}
+
+/* get the next control item from the telnet engine.
+ * ts - telnet info/state
+ * command - pointer to a single unsigned char
+ * option - pointerto a single unsigned char
+ * extra_len - pointer to write the length of the extra data
+ * extra - extra data buffer (for SB)
+ * extra points into inbuf when the whole SB frame was in one buffer,
+ * otherwise into the state. either way it is only valid until the next
+ * call or telnet_end().
+ * every byte costs one lookup in telnet_byteclass and one in telnet_dfa.
+ */
+static int telnet_control(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
+    unsigned char tmp, t;
+    size_t n, taken;
+
+    if((unsigned)ts->telnet_state>=TelnetStateMax) {
+        fprintf(stderr, "Invalid telnet state %d in %p\n", ts->telnet_state, (void*)ts);
+        ts->telnet_state=TelnetStateError;
+        TELNET_COUNT(ts, errors, 1);
+        return 0;
+    }
+
+    while(ts->inbuf_current<ts->inbuf_len) {
+        tmp=ts->inbuf[ts->inbuf_current];
+        t=telnet_dfa[ts->telnet_state][telnet_byteclass[tmp]];
+        ts->telnet_state=t>>4;
+        switch(t&15) {
+            case TelnetActNone:
+                return 0;
+            case TelnetActIacIac:
+                TELNET_COUNT(ts, iac_escapes, 1);
+                return 0;
+            case TelnetActNegotiate:
+                TELNET_COUNT(ts, commands[TELNET_STATS_CMD(tmp)], 1);
+                ts->command=tmp;
+                ts->inbuf_current++;
+                break;
+            case TelnetActUnknown:
+                TELNET_COUNT(ts, unknown, 1);
+                /* fall through */
+            case TelnetActCommand:
+                if(tmp>=xEOF) TELNET_COUNT(ts, commands[TELNET_STATS_CMD(tmp)], 1);
+                ts->command=tmp;
+                ts->option=0;
+                ts->inbuf_current++;
+                if(ts->linebuf && (tmp==EC || tmp==EL)) {
+                    /* edits the line, nothing to return */
+                    if(tmp==EC) {
+                        telnet_linebuf_erase(ts->linebuf);
+                    } else {
+                        telnet_linebuf_kill(ts->linebuf);
+                    }
+                    break;
+                }
+                return telnet_emit(ts, command, option, extra_len, extra);
+            case TelnetActOption:
+                TELNET_COUNT(ts, negotiations[TELNET_STATS_NEG(ts->command)], 1);
+#ifdef JDM_TELNET_STATS_OPTIONS
+                TELNET_COUNT(ts, options[tmp], 1);
+#endif
+                ts->option=tmp;
+                ts->inbuf_current++;
+                return telnet_emit(ts, command, option, extra_len, extra);
+            case TelnetActSbBegin:
+                /* format: IAC SB <option> ... IAC SE */
+                ts->command=SB;
+                ts->extra_len=0;
+                ts->sb_first=1;
+                TELNET_COUNT(ts, commands[TELNET_STATS_CMD(SB)], 1);
+#ifdef JDM_TELNET_STATS
+                ts->sb_truncated=0;
+#endif
+                ts->inbuf_current++;
+                if(telnet_sb_direct(ts, command, option, extra_len, extra)) {
+                    return 1;
+                }
+                break;
+            case TelnetActSeStray:
+                /* IAC SE outside of SB, ignored */
+                TELNET_COUNT(ts, commands[TELNET_STATS_CMD(SE)], 1);
+                ts->inbuf_current++; /* swallow the sequence code */
+                break;
+            case TelnetActSbData:
+                /* copy everything up to the next IAC at once */
+                n=telnet_scan_iac(ts->inbuf+ts->inbuf_current, ts->inbuf_len-ts->inbuf_current);
+                taken=telnet_sb_append(ts, ts->inbuf+ts->inbuf_current, n);
+                ts->inbuf_current+=taken;
+                if(taken<n) {
+                    return telnet_sb_emit(ts, 0, command, option, extra_len, extra);
+                }
+                break;
+            case TelnetActSbIac:
+                ts->inbuf_current++;
+                break;
+            case TelnetActSbEnd:
+                ts->inbuf_current++;
+                return telnet_sb_emit(ts, 1, command, option, extra_len, extra);
+            case TelnetActSbEscape:
+            case TelnetActSbOther:
+                if((ts->flags&TelnetFlagSbStream) && ts->extra_max-ts->extra_len<2) {
+                    /* make room for the escape before reading it, the
+                     * byte after IAC is looked at again next time.
+                     */
+                    ts->telnet_state=TelnetStateSbIac;
+                    return telnet_sb_emit(ts, 0, command, option, extra_len, extra);
+                }
+                ts->inbuf_current++;
+                if(tmp!=IAC) {
+                    /* something unknown. don't escape anything */
+                    unsigned char iac=IAC;
+                    telnet_sb_append(ts, &iac, 1);
+                }
+                telnet_sb_append(ts, &tmp, 1);
+                break;
+        }
+    }
+    return 0;
+}
+
+int telnet_gettext(struct telnet_info *ts, size_t *len, const char **ptr) {
+    assert(ts != NULL);
+    assert(ts->inbuf != NULL);
+    assert(ptr != NULL);
+    assert(len != NULL);
+    if(!telnet_text(ts, len, ptr)) return 0;
+    if(ts->linebuf) {
+        telnet_linebuf_put(ts->linebuf, *len, *ptr);
+        *len=0;
+    }
+    return 1;
+}
+
+int telnet_getcontrol(struct telnet_info *ts, unsigned char *command, unsigned char *option, size_t *extra_len, const  unsigned char **extra) {
+    assert(ts != NULL);
+    assert(ts->inbuf != NULL);
+    assert(command != NULL);
+    assert(option != NULL);
+    return telnet_control(ts, command, option, extra_len, extra);
+}
+
+/* decode the current buffer into an array of events in one pass.
+ * events - caller's array, filled from the start
+ * max_events - number of entries in events
+ * returns the number of events written.
+ * empty text spans are not reported. a TelnetEventSubneg event that was
+ * copied out of inbuf ends the batch early, because the next SB would reuse
+ * the buffer its extra points to. call again while telnet_continue() is
+ * true.
+ */
+int telnet_parse_batch(struct telnet_info *ts, struct telnet_event *events, int max_events) {
+    int n=0;
+    struct telnet_event *ev;
+    const char *text;
+    const unsigned char *extra;
+    size_t len;
+    unsigned char command, option;
+
+    assert(ts != NULL);
+    assert(ts->inbuf != NULL);
+    assert(events != NULL || max_events <= 0);
+
+    while(n<max_events && (ts->inbuf_current<ts->inbuf_len || telnet_nextseg(ts))) {
+        ev=&events[n];
+        switch(ts->telnet_state) {
+            case TelnetStateText:
+            case TelnetStateIacIac:
+                if(!telnet_text(ts, &len, &text)) return n;
+                if(!len) break;
+                if(ts->linebuf) {
+                    telnet_linebuf_put(ts->linebuf, len, text);
+                    break;
+                }
+                ev->type=TelnetEventText;
+                ev->command=0;
+                ev->option=0;
+                ev->flags=0;
+                ev->len=(unsigned)len;
+                ev->seg=(unsigned)ts->iov_index;
+                if(text==telnet_cr) {
+                    ev->offset=0;
+                    ev->extra=(const unsigned char*)text;
+                } else {
+                    ev->offset=(unsigned)((const unsigned char*)text-ts->inbuf);
+                    ev->extra=NULL;
+                }
+                n++;
+                break;
+            case TelnetStateIacCommand:
+            case TelnetStateIacOption:
+            case TelnetStateSb:
+            case TelnetStateSbIac:
+                if(!telnet_control(ts, &command, &option, &len, &extra)) break;
+                if(command==SB) {
+                    ev->type=TelnetEventSubneg;
+                } else if(command>=WILL && command<=DONT) {
+                    ev->type=TelnetEventNegotiate;
+                } else {
+                    ev->type=TelnetEventCommand;
+                }
+                ev->command=command;
+                ev->option=option;
+                ev->flags=command==SB ? (unsigned char)ts->sb_chunk : 0;
+                ev->len=(unsigned)len;
+                ev->offset=0;
+                ev->seg=0;
+                ev->extra=extra;
+                n++;
+                if(extra==ts->extra) return n;
+                break;
+            default:
+                return n;
+        }
+    }
+    return n;
 }
 
 /* returns true while telnet_getXXX() can still be called */
 int telnet_continue(struct telnet_info *ts) {
-    return ts->telnet_state == TelnetStateError || (ts->inbuf_current < ts->inbuf_len);
+    return ts->telnet_state != TelnetStateError && (ts->inbuf_current < ts->inbuf_len || telnet_nextseg(ts));
+}
+
+/* consumes the rest of the current buffer without parsing it. after
+ * telnet_beginv() that is the rest of the current iovec, and the iovecs
+ * after telnet_segment() are not parsed either.
+ * rest - set to the first unparsed byte
+ * returns the number of unparsed bytes.
+ */
+size_t telnet_rest(struct telnet_info *ts, const char **rest) {
+    size_t n;
+
+    assert(ts != NULL);
+    assert(rest != NULL);
+    *rest=(const char*)ts->inbuf+ts->inbuf_current;
+    n=ts->inbuf_len-ts->inbuf_current;
+    ts->inbuf_current=ts->inbuf_len;
+    ts->iovcnt=0;
+    return n;
 }
 
 /* finishes an update cycle. the buffer passed as telnet_begin is no longer
@@ -525,21 +1751,1245 @@ int telnet_end(struct telnet_info *ts) {
     int result=1;
 
     /* check that the buffer was completely consumed */
-    if(ts->inbuf_current<ts->inbuf_len) {
-#ifdef JDM_TELNET_DEBUG
-        fprintf(stderr, "Unconsumed data!\n");
-#endif
+    if(telnet_nextseg(ts)) {
         result=0;
     }
 
     ts->inbuf=0;
     ts->inbuf_len=0;
+    ts->iov=NULL;
+    ts->iovcnt=0;
+    ts->iov_index=0;
+    /* a grown SB buffer is only kept while an SB is in progress */
+    if(ts->telnet_state!=TelnetStateSb && ts->telnet_state!=TelnetStateSbIac) {
+        telnet_sb_release(ts);
+    }
     return result;
 }
 
 /* releases the telnet state */
 void telnet_free(struct telnet_info *ts) {
+    if(!ts) return;
+    telnet_fini(ts);
     free(ts);
 }
+
+/* slots are padded to a cache line so neighbouring connections never share
+ * one. released slots are reused first, while they are still in cache.
+ */
+#define TELNET_POOL_ALIGN 64
+
+struct telnet_pool_slab {
+    struct telnet_pool_slab *next;
+    void *alloc;                /* pointer to pass to free() */
+};
+
+struct telnet_pool {
+    size_t extra_max, slot_size, per_slab;
+    void *free;                 /* list of free slots, linked through the slot */
+    struct telnet_pool_slab *slabs;
+};
+
+/* create a pool of telnet states that all have the same extra_max.
+ * memory is taken from the system per_slab slots at a time and only given
+ * back by telnet_pool_free().
+ */
+struct telnet_pool *telnet_pool_create(size_t extra_max, size_t per_slab) {
+    struct telnet_pool *pool=malloc(sizeof *pool);
+    if(!pool) return NULL;
+    pool->extra_max=telnet_extra_size(extra_max);
+    pool->slot_size=(telnet_sizeof(pool->extra_max)+TELNET_POOL_ALIGN-1) & ~(size_t)(TELNET_POOL_ALIGN-1);
+    pool->per_slab=per_slab ? per_slab : 64;
+    pool->free=NULL;
+    pool->slabs=NULL;
+    return pool;
+}
+
+static int telnet_pool_grow(struct telnet_pool *pool) {
+    struct telnet_pool_slab *slab;
+    unsigned char *base;
+    void *alloc;
+    size_t i;
+
+    alloc=malloc(TELNET_POOL_ALIGN + pool->slot_size * pool->per_slab + TELNET_POOL_ALIGN - 1);
+    if(!alloc) return 0;
+    /* slab header in the first line, slots aligned after it */
+    slab=alloc;
+    base=(unsigned char*)alloc + TELNET_POOL_ALIGN;
+    base=(unsigned char*)(((size_t)base + TELNET_POOL_ALIGN - 1) & ~(size_t)(TELNET_POOL_ALIGN - 1));
+    slab->alloc=alloc;
+    slab->next=pool->slabs;
+    pool->slabs=slab;
+    /* push in reverse so slots are handed out in address order */
+    for(i=pool->per_slab;i-->0;) {
+        void **slot=(void**)(base + i * pool->slot_size);
+        *slot=pool->free;
+        pool->free=slot;
+    }
+    return 1;
+}
+
+/* take an initialized telnet state from the pool. O(1) unless a new slab
+ * has to be allocated. returns NULL if out of memory.
+ */
+struct telnet_info *telnet_pool_acquire(struct telnet_pool *pool) {
+    void **slot;
+
+    assert(pool != NULL);
+    if(!pool->free && !telnet_pool_grow(pool)) return NULL;
+    slot=pool->free;
+    pool->free=*slot;
+    return telnet_init(slot, pool->extra_max);
+}
+
+/* give a state from telnet_pool_acquire() back to its pool */
+void telnet_pool_release(struct telnet_pool *pool, struct telnet_info *ts) {
+    void **slot=(void**)ts;
+
+    assert(pool != NULL);
+    if(!ts) return;
+    telnet_fini(ts);
+    *slot=pool->free;
+    pool->free=slot;
+}
+
+/* free the pool and every slab. states still acquired become invalid. */
+void telnet_pool_free(struct telnet_pool *pool) {
+    struct telnet_pool_slab *slab, *next;
+
+    if(!pool) return;
+    for(slab=pool->slabs;slab;slab=next) {
+        next=slab->next;
+        free(slab->alloc);
+    }
+    free(pool);
+}
+
+/* describe text with every IAC doubled as a list of iovecs for writev().
+ * nothing is copied: each IAC ends one entry and starts the next, so the
+ * same byte is sent twice straight out of text.
+ * iov - array to fill
+ * iov_max - entries in iov, must be at least 2 to make progress on an IAC
+ * consumed - number of bytes of text that the entries cover
+ * returns the number of entries used. call again with the rest of text
+ * when *consumed < len.
+ */
+int telnet_escape_iov(struct iovec *iov, int iov_max, size_t len, const char *text, size_t *consumed) {
+    const unsigned char *p=(const unsigned char*)text;
+    size_t seg=0, i=0;
+    int n=0;
+
+    assert(iov != NULL || iov_max <= 0);
+    assert(consumed != NULL);
+
+    while(n<iov_max) {
+        i+=telnet_scan_iac(p+i, len-i);
+        if(i>=len) {
+            if(seg<len) {
+                iov[n].iov_base=(void*)(p+seg);
+                iov[n].iov_len=len-seg;
+                n++;
+            }
+            *consumed=len;
+            return n;
+        }
+        if(n==iov_max-1) {
+            /* no room for the entry that repeats this IAC, stop before it */
+            if(i>seg) {
+                iov[n].iov_base=(void*)(p+seg);
+                iov[n].iov_len=i-seg;
+                n++;
+            }
+            *consumed=i;
+            return n;
+        }
+        /* up to and including the IAC, the next entry starts on it again */
+        iov[n].iov_base=(void*)(p+seg);
+        iov[n].iov_len=i+1-seg;
+        n++;
+        seg=i++;
+    }
+    *consumed=0;
+    return 0;
+}
+
+/* copy text to out with every IAC doubled.
+ * consumed - number of bytes of text that fit in out
+ * returns the number of bytes written to out.
+ */
+size_t telnet_escape(char *out, size_t out_max, size_t len, const char *text, size_t *consumed) {
+    const unsigned char *p=(const unsigned char*)text;
+    size_t i=0, o=0, n;
+
+    assert(out != NULL || out_max == 0);
+    assert(consumed != NULL);
+
+    while(i<len) {
+        n=telnet_scan_iac(p+i, len-i);
+        if(n>out_max-o) n=out_max-o;
+        memcpy(out+o, p+i, n);
+        o+=n;
+        i+=n;
+        if(i>=len || p[i]!=IAC || out_max-o<2) break;
+        out[o++]=(char)IAC;
+        out[o++]=(char)IAC;
+        i++;
+    }
+    *consumed=i;
+    return o;
+}
+
+/* IAC <command>. writes 2 bytes to out. */
+size_t telnet_encode_command(unsigned char *out, unsigned char command) {
+    out[0]=IAC;
+    out[1]=command;
+    return 2;
+}
+
+/* IAC WILL/WONT/DO/DONT <option>. writes 3 bytes to out. */
+size_t telnet_encode_option(unsigned char *out, unsigned char command, unsigned char option) {
+    out[0]=IAC;
+    out[1]=command;
+    out[2]=option;
+    return 3;
+}
+
+/* IAC SB <option> data... IAC SE, with IAC in data doubled.
+ * returns the number of bytes written, or 0 if out_max is too small.
+ */
+size_t telnet_encode_subneg(unsigned char *out, size_t out_max, unsigned char option, size_t len, const unsigned char *data) {
+    size_t n, consumed;
+
+    if(out_max<5) return 0;
+    out[0]=IAC;
+    out[1]=SB;
+    out[2]=option;
+    n=3+telnet_escape((char*)out+3, out_max-5, len, (const char*)data, &consumed);
+    if(consumed<len) return 0;
+    out[n++]=IAC;
+    out[n++]=SE;
+    return n;
+}
+
+/* IAC SB NAWS <width16> <height16> IAC SE. returns 1 if sb is one. */
+int telnet_decode_naws(size_t len, const unsigned char *sb, struct telnet_naws *naws) {
+    if(len!=5 || sb[0]!=TELOPT_NAWS) return 0;
+    naws->width=(unsigned)sb[1]<<8 | sb[2];
+    naws->height=(unsigned)sb[3]<<8 | sb[4];
+    return 1;
+}
+
+/* IAC SB TERMINAL-TYPE IS <name> IAC SE. returns 1 if sb is one. */
+int telnet_decode_ttype(size_t len, const unsigned char *sb, const char **name, size_t *name_len) {
+    if(len<2 || sb[0]!=TELOPT_TTYPE || sb[1]!=TELQUAL_IS) return 0;
+    *name=(const char*)sb+2;
+    *name_len=len-2;
+    return 1;
+}
+
+/* start on IAC SB NEW-ENVIRON IS/SEND/INFO <list> IAC SE. returns
+ * TELQUAL_IS, TELQUAL_SEND or TELQUAL_INFO, or -1 if sb is not one.
+ */
+int telnet_environ_begin(struct telnet_sbiter *it, size_t len, const unsigned char *sb) {
+    if(len<2 || sb[0]!=TELOPT_NEW_ENVIRON || sb[1]>TELQUAL_INFO) return -1;
+    it->p=sb+2;
+    it->end=sb+len;
+    return sb[1];
+}
+
+/* end of a name or value: the next unescaped VAR or USERVAR, or VALUE after a name */
+static const unsigned char *telnet_environ_span(const unsigned char *p, const unsigned char *end, int value, unsigned char *escaped) {
+    for(;p<end;p++) {
+        if(*p==ENV_ESC) {
+            *escaped=1;
+            if(++p==end) break;
+        } else if(*p==NEW_ENV_VAR || *p==ENV_USERVAR || (!value && *p==NEW_ENV_VALUE)) {
+            break;
+        }
+    }
+    return p;
+}
+
+/* the next variable. returns 0 at the end of the list, or at a byte
+ * that cannot start a variable.
+ */
+int telnet_environ_next(struct telnet_sbiter *it, struct telnet_environ *var) {
+    const unsigned char *p=it->p;
+
+    if(p>=it->end || (*p!=NEW_ENV_VAR && *p!=ENV_USERVAR)) return 0;
+    var->type=*p++;
+    var->escaped=0;
+    var->name=(const char*)p;
+    p=telnet_environ_span(p, it->end, 0, &var->escaped);
+    var->name_len=(const char*)p-var->name;
+    var->has_value=p<it->end && *p==NEW_ENV_VALUE;
+    if(var->has_value) p++;
+    var->value=(const char*)p;
+    if(var->has_value) p=telnet_environ_span(p, it->end, 1, &var->escaped);
+    var->value_len=(const char*)p-var->value;
+    it->p=p;
+    return 1;
+}
+
+/* copy a name or value without its ENV_ESC bytes. out may be in, it never
+ * grows. returns the new length.
+ */
+size_t telnet_environ_unescape(char *out, size_t len, const char *in) {
+    size_t i, n=0;
+
+    for(i=0;i<len;i++) {
+        if(in[i]==ENV_ESC && i+1<len) i++;
+        out[n++]=in[i];
+    }
+    return n;
+}
+
+/* start on IAC SB LINEMODE SLC <triplets> IAC SE. returns 1 if sb is one. */
+int telnet_slc_begin(struct telnet_sbiter *it, size_t len, const unsigned char *sb) {
+    if(len<2 || sb[0]!=TELOPT_LINEMODE || sb[1]!=LM_SLC) return 0;
+    it->p=sb+2;
+    it->end=sb+len;
+    return 1;
+}
+
+/* the next function, value and flags. returns 0 at the end. */
+int telnet_slc_next(struct telnet_sbiter *it, struct telnet_slc *slc) {
+    if(it->end-it->p<3) return 0;
+    slc->function=it->p[SLC_FUNC];
+    slc->flags=it->p[SLC_FLAGS];
+    slc->value=it->p[SLC_VALUE];
+    it->p+=3;
+    return 1;
+}
+
+#define TELNET_BIT(set, opt) (((set)[(opt)>>3]>>((opt)&7))&1)
+
+static void telnet_bit_put(unsigned char *set, unsigned char opt, int on) {
+    if(on) {
+        set[opt>>3]|=(unsigned char)(1u<<(opt&7));
+    } else {
+        set[opt>>3]&=(unsigned char)~(1u<<(opt&7));
+    }
+}
+
+static void telnet_q_put(struct telnet_qside *q, unsigned char opt, int yes, int want, int opp) {
+    telnet_bit_put(q->yes, opt, yes);
+    telnet_bit_put(q->want, opt, want);
+    telnet_bit_put(q->opp, opt, opp);
+}
+
+/* ask to change one side of an option.
+ * pos and neg are the requests we send: DO/DONT for him, WILL/WONT for us.
+ */
+static size_t telnet_q_ask(struct telnet_qside *q, unsigned char opt, int enable, unsigned char pos, unsigned char neg, unsigned char *out) {
+    int yes=TELNET_BIT(q->yes, opt);
+
+    enable=!!enable;
+    if(!TELNET_BIT(q->want, opt)) {
+        if(yes==enable) return 0; /* already there */
+        /* NO -> WANTYES, YES -> WANTNO */
+        telnet_bit_put(q->want, opt, 1);
+        return telnet_encode_option(out, enable ? pos : neg, opt);
+    }
+    /* already negotiating toward !yes, queue the opposite or cancel it */
+    telnet_bit_put(q->opp, opt, (!yes) != enable);
+    return 0;
+}
+
+/* handle the peer's answer or request for one side of an option.
+ * positive is true for WILL/DO. pos and neg are our replies.
+ * a reply is only sent where RFC 1143 calls for one, so the two ends can
+ * never loop.
+ */
+static size_t telnet_q_recv(struct telnet_qside *q, unsigned char opt, int positive, unsigned char pos, unsigned char neg, unsigned char *out) {
+    int yes=TELNET_BIT(q->yes, opt), want=TELNET_BIT(q->want, opt), opp=TELNET_BIT(q->opp, opt);
+
+    if(positive) {
+        if(!want) {
+            if(yes) return 0;
+            /* NO: the peer asks */
+            if(!TELNET_BIT(q->allow, opt)) return telnet_encode_option(out, neg, opt);
+            telnet_q_put(q, opt, 1, 0, 0);
+            return telnet_encode_option(out, pos, opt);
+        }
+        if(yes) {
+            /* WANTNO: our refusal was answered with agreement, an error */
+            telnet_q_put(q, opt, opp, 0, 0);
+            return 0;
+        }
+        /* WANTYES */
+        if(opp) {
+            telnet_q_put(q, opt, 1, 1, 0);
+            return telnet_encode_option(out, neg, opt);
+        }
+        telnet_q_put(q, opt, 1, 0, 0);
+        return 0;
+    }
+    if(!want) {
+        if(!yes) return 0;
+        /* YES: the peer turns it off */
+        telnet_q_put(q, opt, 0, 0, 0);
+        return telnet_encode_option(out, neg, opt);
+    }
+    if(yes && opp) {
+        /* WANTNO with the opposite queued */
+        telnet_q_put(q, opt, 0, 1, 0);
+        return telnet_encode_option(out, pos, opt);
+    }
+    /* WANTNO or WANTYES */
+    telnet_q_put(q, opt, 0, 0, 0);
+    return 0;
+}
+
+/* set the options we agree to when the other end asks.
+ * us - we will enable the option when sent DO
+ * him - we let the other end enable it when sent WILL
+ */
+void telnet_q_allow(struct telnet_info *ts, unsigned char option, int us, int him) {
+    telnet_bit_put(ts->q_us.allow, option, us);
+    telnet_bit_put(ts->q_him.allow, option, him);
+}
+
+/* ask to enable or disable an option on our side (WILL/WONT) */
+size_t telnet_q_request_us(struct telnet_info *ts, unsigned char option, int enable, unsigned char *out) {
+    return telnet_q_ask(&ts->q_us, option, enable, WILL, WONT, out);
+}
+
+/* ask the other end to enable or disable an option (DO/DONT) */
+size_t telnet_q_request_him(struct telnet_info *ts, unsigned char option, int enable, unsigned char *out) {
+    return telnet_q_ask(&ts->q_him, option, enable, DO, DONT, out);
+}
+
+/* feed a WILL/WONT/DO/DONT from telnet_getcontrol() to the option state.
+ * other commands are ignored.
+ */
+size_t telnet_q_receive(struct telnet_info *ts, unsigned char command, unsigned char option, unsigned char *out) {
+    switch(command) {
+        case WILL:
+            return telnet_q_recv(&ts->q_him, option, 1, DO, DONT, out);
+        case WONT:
+            return telnet_q_recv(&ts->q_him, option, 0, DO, DONT, out);
+        case DO:
+            return telnet_q_recv(&ts->q_us, option, 1, WILL, WONT, out);
+        case DONT:
+            return telnet_q_recv(&ts->q_us, option, 0, WILL, WONT, out);
+    }
+    return 0;
+}
+
+/* true if the option is in the YES state on our side */
+int telnet_q_enabled_us(const struct telnet_info *ts, unsigned char option) {
+    return TELNET_BIT(ts->q_us.yes, option) && !TELNET_BIT(ts->q_us.want, option);
+}
+
+/* true if the option is in the YES state on the other end */
+int telnet_q_enabled_him(const struct telnet_info *ts, unsigned char option) {
+    return TELNET_BIT(ts->q_him.yes, option) && !TELNET_BIT(ts->q_him.want, option);
+}
+
+#ifdef JDM_TELNET_MCCP
+#include <zlib.h>
+
+struct telnet_mccp {
+    z_stream z;
+    int inflate;                /* decompressor for test clients */
+    int done;                   /* the stream was finished */
+};
+
+/* start a compressed stream for one connection.
+ * level - zlib level 0-9, or -1 for the default
+ * window_bits - 9-15, the window is 1<<window_bits bytes
+ * mem_level - 1-9, the hash tables are 1<<(mem_level+9) bytes
+ *   0 for either picks the zlib default. deflate needs about
+ *   (1<<(window_bits+2)) + (1<<(mem_level+9)) bytes, so 12 and 5 bound a
+ *   connection to about 32K instead of 256K.
+ * MCCP clients cannot know a preset dictionary, so none is used.
+ * returns NULL if out of memory.
+ */
+struct telnet_mccp *telnet_mccp_create(int level, int window_bits, int mem_level) {
+    struct telnet_mccp *mc=malloc(sizeof *mc);
+
+    if(!mc) return NULL;
+    if(!window_bits) window_bits=MAX_WBITS;
+    if(window_bits<9) window_bits=9;
+    if(window_bits>15) window_bits=15;
+    if(!mem_level) mem_level=8;
+    if(mem_level<1) mem_level=1;
+    if(mem_level>9) mem_level=9;
+    memset(&mc->z, 0, sizeof(mc->z));
+    mc->inflate=0;
+    mc->done=0;
+    if(deflateInit2(&mc->z, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY)!=Z_OK) {
+        free(mc);
+        return NULL;
+    }
+    return mc;
+}
+
+/* the other end of a telnet_mccp_create() stream */
+struct telnet_mccp *telnet_mccp_inflate_create(void) {
+    struct telnet_mccp *mc=malloc(sizeof *mc);
+
+    if(!mc) return NULL;
+    memset(&mc->z, 0, sizeof(mc->z));
+    mc->inflate=1;
+    mc->done=0;
+    if(inflateInit(&mc->z)!=Z_OK) {
+        free(mc);
+        return NULL;
+    }
+    return mc;
+}
+
+void telnet_mccp_free(struct telnet_mccp *mc) {
+    if(!mc) return;
+    if(mc->inflate) {
+        inflateEnd(&mc->z);
+    } else {
+        deflateEnd(&mc->z);
+    }
+    free(mc);
+}
+
+/* write IAC SB COMPRESS2 IAC SE, 5 bytes. everything sent after it goes
+ * through telnet_mccp_compress().
+ */
+size_t telnet_mccp_start(unsigned char *out) {
+    out[0]=IAC;
+    out[1]=SB;
+    out[2]=TELOPT_COMPRESS2;
+    out[3]=IAC;
+    out[4]=SE;
+    return 5;
+}
+
+/* compress already escaped telnet data to out.
+ * consumed - number of bytes of text taken
+ * flush - enum telnet_mccp_flush
+ * returns the number of bytes written to out. when that is out_max the
+ * flush may not be complete yet: call again with the rest of text, or with
+ * len 0, and the same flush until it returns less.
+ */
+size_t telnet_mccp_compress(struct telnet_mccp *mc, unsigned char *out, size_t out_max, size_t len, const char *text, size_t *consumed, int flush) {
+    static const int zflush[]={ Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+
+    assert(mc != NULL && !mc->inflate);
+    assert(consumed != NULL);
+    assert(flush>=TelnetMccpNone && flush<=TelnetMccpFinish);
+    *consumed=0;
+    if(mc->done) return 0;
+    mc->z.next_in=(Bytef*)text;
+    mc->z.avail_in=(uInt)len;
+    mc->z.next_out=out;
+    mc->z.avail_out=(uInt)out_max;
+    if(deflate(&mc->z, zflush[flush])==Z_STREAM_END) mc->done=1;
+    *consumed=len-mc->z.avail_in;
+    return out_max-mc->z.avail_out;
+}
+
+/* decompress what a telnet_mccp_compress() stream sent.
+ * consumed - number of bytes of in taken
+ * produced - number of bytes written to out
+ * returns 1 when the compressed stream ended, the rest of in from consumed
+ * on is plain telnet. returns 0 to go on, -1 if the data is corrupt.
+ */
+int telnet_mccp_decompress(struct telnet_mccp *mc, unsigned char *out, size_t out_max, size_t len, const char *in, size_t *consumed, size_t *produced) {
+    int e;
+
+    assert(mc != NULL && mc->inflate);
+    assert(consumed != NULL);
+    assert(produced != NULL);
+    *consumed=0;
+    *produced=0;
+    if(mc->done) return 1;
+    mc->z.next_in=(Bytef*)in;
+    mc->z.avail_in=(uInt)len;
+    mc->z.next_out=out;
+    mc->z.avail_out=(uInt)out_max;
+    e=inflate(&mc->z, Z_SYNC_FLUSH);
+    *consumed=len-mc->z.avail_in;
+    *produced=out_max-mc->z.avail_out;
+    if(e==Z_STREAM_END) {
+        mc->done=1;
+        return 1;
+    }
+    /* Z_BUF_ERROR only means no progress was possible */
+    return e==Z_OK || e==Z_BUF_ERROR ? 0 : -1;
+}
+#endif /* JDM_TELNET_MCCP */
+
+/* an immutable message shared by many output queues, see
+ * telnet_frame_create()
+ */
+struct telnet_frame {
+    int refs;
+    size_t len;
+#ifdef JDM_TELNET_MCCP
+    unsigned long adler;        /* adler32 of data */
+    unsigned long *block_adler; /* of every 65535 bytes, if longer than that */
+    size_t zlen;                /* 0 until telnet_frame_compress() */
+    unsigned char *zdata;       /* raw deflate blocks, ending byte aligned */
+#endif
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+    unsigned char data[];
+#else
+    unsigned char data[0]; /* hack to do flex arrays in C89 */
+#endif
+};
+
+/* frames are shared between threads, output queues are not */
+#if defined(__GNUC__)
+#define TELNET_REF_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_ACQ_REL)
+#else
+#define TELNET_REF_ADD(p, n) (*(p)+=(n)) /* single threaded only */
+#endif
+
+#define TELNET_STORED_MAX 65535 /* longest stored deflate block */
+
+/* one link of an output queue. an append is never split between two
+ * segments, so every segment holds whole messages. a segment either owns
+ * its bytes, or points into a frame.
+ */
+struct telnet_outseg {
+    struct telnet_outseg *next;
+    unsigned char *data;        /* buf, or frame->data or frame->zdata */
+    size_t start, end, cap;     /* start is the first byte not written yet */
+    int compress;               /* queued after MCCP was turned on */
+    int zend;                   /* enum telnet_outq_end */
+    struct telnet_frame *frame; /* reference held until the bytes are sent */
+    unsigned long adler;        /* shared MCCP: adler32 of the data inside, */
+    size_t alen;                /*   counted once the segment is sent */
+    int joined;                 /* shared MCCP: its stored header ends the segment before */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+    unsigned char buf[];
+#else
+    unsigned char buf[0]; /* hack to do flex arrays in C89 */
+#endif
+};
+
+/* segments that end an MCCP stream. discarding output never drops them. */
+enum telnet_outq_end {
+    TelnetOutqData,
+    TelnetOutqFinish,           /* empty, zlib finishes the stream here */
+    TelnetOutqTrailer,          /* last stored block and adler32, filled in when sent */
+};
+
+#define TELNET_OUTQ_NODES 16    /* frame links kept for reuse per queue */
+
+struct telnet_outq {
+    struct telnet_outseg *head, *tail;
+    struct telnet_outseg *spare; /* one emptied segment kept for reuse */
+    struct telnet_outseg *nodes; /* emptied frame links kept for reuse */
+    int nnodes;
+    size_t seg_size;
+    size_t pending;             /* bytes queued, compressed ones included */
+    size_t low_water, high_water;
+    int throttled;
+    struct telnet_mccp *mc;
+    struct telnet_outseg *zseg; /* compressed bytes waiting to be written */
+    int zsync;                  /* zlib holds input that was not flushed */
+    int zend;                   /* telnet_outq_mccp_end() was called */
+    int shared;                 /* MCCP from stored blocks and frames */
+    unsigned long adler;        /* shared: adler32 of what was sent */
+};
+
+/* escape text once for sending to any number of connections. the frame
+ * starts with one reference, owned by the caller, and is never changed
+ * once it is queued. NULL if out of memory.
+ */
+struct telnet_frame *telnet_frame_create(size_t len, const char *text) {
+    const unsigned char *p=(const unsigned char*)text;
+    struct telnet_frame *f;
+    size_t i, need=len, consumed;
+
+    for(i=telnet_scan_iac(p, len);i<len;i+=1+telnet_scan_iac(p+i+1, len-i-1)) need++;
+    f=malloc(sizeof(*f)+need);
+    if(!f) return NULL;
+    f->refs=1;
+    f->len=telnet_escape((char*)f->data, need, len, text, &consumed);
+#ifdef JDM_TELNET_MCCP
+    f->adler=adler32(adler32(0, Z_NULL, 0), f->data, (uInt)f->len);
+    f->block_adler=NULL;
+    f->zlen=0;
+    f->zdata=NULL;
+    if(f->len>TELNET_STORED_MAX) {
+        f->block_adler=malloc((f->len/TELNET_STORED_MAX+1)*sizeof(*f->block_adler));
+        if(!f->block_adler) {
+            free(f);
+            return NULL;
+        }
+        for(i=0;i*TELNET_STORED_MAX<f->len;i++) {
+            consumed=f->len-i*TELNET_STORED_MAX;
+            if(consumed>TELNET_STORED_MAX) consumed=TELNET_STORED_MAX;
+            f->block_adler[i]=adler32(adler32(0, Z_NULL, 0), f->data+i*TELNET_STORED_MAX, (uInt)consumed);
+        }
+    }
+#endif
+    return f;
+}
+
+/* take another reference */
+struct telnet_frame *telnet_frame_ref(struct telnet_frame *f) {
+    TELNET_REF_ADD(&f->refs, 1);
+    return f;
+}
+
+/* drop a reference, the last one frees the frame. safe from any thread. */
+void telnet_frame_unref(struct telnet_frame *f) {
+    if(!f || TELNET_REF_ADD(&f->refs, -1)) return;
+#ifdef JDM_TELNET_MCCP
+    free(f->block_adler);
+    free(f->zdata);
+#endif
+    free(f);
+}
+
+/* escaped length of the frame */
+size_t telnet_frame_len(const struct telnet_frame *f) {
+    return f->len;
+}
+
+#ifdef JDM_TELNET_MCCP
+/* compress the frame once, for queues in shared MCCP mode. the result is
+ * raw deflate blocks from an empty window, ending in a sync flush, so it
+ * can be spliced into any stream. call it before the frame is queued, it
+ * is not thread safe. returns 0 if zlib failed, the frame is then sent in
+ * stored blocks, as it is when compressing does not make it smaller.
+ */
+int telnet_frame_compress(struct telnet_frame *f, int level) {
+    z_stream z;
+    uLong max;
+    int e;
+
+    if(f->zlen || !f->len) return 1;
+    memset(&z, 0, sizeof(z));
+    if(deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK) return 0;
+    max=deflateBound(&z, (uLong)f->len)+16; /* the bound leaves out the sync flush */
+    f->zdata=malloc(max);
+    if(!f->zdata) {
+        deflateEnd(&z);
+        return 0;
+    }
+    z.next_in=f->data;
+    z.avail_in=(uInt)f->len;
+    z.next_out=f->zdata;
+    z.avail_out=(uInt)max;
+    e=deflate(&z, Z_SYNC_FLUSH);
+    deflateEnd(&z);
+    if(e!=Z_OK || z.avail_in || z.avail_out==0) {
+        free(f->zdata);
+        f->zdata=NULL;
+        return 0;
+    }
+    f->zlen=max-z.avail_out;
+    if(f->zlen>=f->len+5*(f->len/TELNET_STORED_MAX+1)) {
+        /* incompressible, stored blocks are smaller */
+        free(f->zdata);
+        f->zdata=NULL;
+        f->zlen=0;
+    }
+    return 1;
+}
+#endif
+
+/* create an empty output queue.
+ * seg_size - usual segment size, 0 for 4096. longer appends get a segment
+ *   of their own.
+ * low_water, high_water - telnet_outq_throttled() turns on when more than
+ *   high_water bytes are queued, and off again at low_water or less.
+ */
+struct telnet_outq *telnet_outq_create(size_t seg_size, size_t low_water, size_t high_water) {
+    struct telnet_outq *q=calloc(1, sizeof *q);
+
+    if(!q) return NULL;
+    q->seg_size=seg_size ? seg_size : 4096;
+    q->low_water=low_water;
+    q->high_water=high_water>low_water ? high_water : low_water;
+    return q;
+}
+
+/* a segment left the queue, sent or discarded */
+static void telnet_outq_release(struct telnet_outq *q, struct telnet_outseg *seg) {
+    if(seg->frame) {
+        telnet_frame_unref(seg->frame);
+        if(q->nnodes<TELNET_OUTQ_NODES) {
+            seg->next=q->nodes;
+            q->nodes=seg;
+            q->nnodes++;
+            return;
+        }
+    } else if(!q->spare && seg->cap==q->seg_size) {
+        q->spare=seg;
+        return;
+    }
+    free(seg);
+}
+
+/* frees the queue and anything still in it. the MCCP stream is not freed. */
+void telnet_outq_free(struct telnet_outq *q) {
+    struct telnet_outseg *seg, *next;
+
+    if(!q) return;
+    for(seg=q->head;seg;seg=next) {
+        next=seg->next;
+        telnet_frame_unref(seg->frame);
+        free(seg);
+    }
+    for(seg=q->nodes;seg;seg=next) {
+        next=seg->next;
+        free(seg);
+    }
+    free(q->spare);
+    free(q->zseg);
+    free(q);
+}
+
+static void telnet_outq_water(struct telnet_outq *q) {
+    if(q->pending>q->high_water) {
+        q->throttled=1;
+    } else if(q->pending<=q->low_water) {
+        q->throttled=0;
+    }
+}
+
+static void telnet_outq_link(struct telnet_outq *q, struct telnet_outseg *seg) {
+    seg->next=NULL;
+    seg->compress=q->mc && !q->zend;
+    seg->zend=TelnetOutqData;
+    seg->adler=1;
+    seg->alen=0;
+    seg->joined=0;
+    if(q->tail) {
+        q->tail->next=seg;
+    } else {
+        q->head=seg;
+    }
+    q->tail=seg;
+}
+
+/* room for len more bytes at the end of the queue, in one segment */
+static struct telnet_outseg *telnet_outq_room(struct telnet_outq *q, size_t len) {
+    struct telnet_outseg *seg=q->tail;
+    size_t cap;
+
+    if(seg && !seg->frame && !seg->zend && seg->cap-seg->end>=len && seg->compress==(q->mc && !q->zend)) return seg;
+    if(len<=q->seg_size && q->spare) {
+        seg=q->spare;
+        q->spare=NULL;
+    } else {
+        cap=len>q->seg_size ? len : q->seg_size;
+        seg=malloc(sizeof(*seg)+cap);
+        if(!seg) return NULL;
+        seg->cap=cap;
+        seg->data=seg->buf;
+        seg->frame=NULL;
+    }
+    seg->start=seg->end=0;
+    telnet_outq_link(q, seg);
+    return seg;
+}
+
+/* point the end of the queue at len bytes of frame data */
+static struct telnet_outseg *telnet_outq_ref(struct telnet_outq *q, struct telnet_frame *f, unsigned char *data, size_t len) {
+    struct telnet_outseg *seg=q->nodes;
+
+    if(seg) {
+        q->nodes=seg->next;
+        q->nnodes--;
+    } else {
+        seg=malloc(sizeof(*seg));
+        if(!seg) return NULL;
+    }
+    seg->data=data;
+    seg->start=0;
+    seg->end=seg->cap=len;
+    seg->frame=telnet_frame_ref(f);
+    telnet_outq_link(q, seg);
+    q->pending+=len;
+    return seg;
+}
+
+#ifdef JDM_TELNET_MCCP
+/* header of a stored deflate block of len bytes */
+static void telnet_stored_header(unsigned char *out, size_t len, int final) {
+    out[0]=final ? 1 : 0;
+    out[1]=(unsigned char)len;
+    out[2]=(unsigned char)(len>>8);
+    out[3]=(unsigned char)~len;
+    out[4]=(unsigned char)(~len>>8);
+}
+#endif
+
+static int telnet_outq_put(struct telnet_outq *q, size_t len, const char *data, int escape) {
+    const unsigned char *p=(const unsigned char*)data;
+    struct telnet_outseg *seg;
+    unsigned char *out;
+    size_t i, need=len, room, consumed;
+#ifdef JDM_TELNET_MCCP
+    size_t n;
+#endif
+
+    if(escape) {
+        for(i=telnet_scan_iac(p, len);i<len;i+=1+telnet_scan_iac(p+i+1, len-i-1)) need++;
+    }
+    room=need;
+#ifdef JDM_TELNET_MCCP
+    /* escaping ends a block one byte early rather than split IAC IAC */
+    if(q->shared) room+=5*(need/(TELNET_STORED_MAX-1)+1);
+#endif
+    seg=telnet_outq_room(q, room);
+    if(!seg) return 0;
+    out=seg->data+seg->end;
+#ifdef JDM_TELNET_MCCP
+    if(q->shared) {
+        while(len) {
+            if(escape) {
+                n=telnet_escape((char*)out+5, TELNET_STORED_MAX, len, data, &consumed);
+            } else {
+                n=consumed=len<TELNET_STORED_MAX ? len : TELNET_STORED_MAX;
+                memcpy(out+5, data, n);
+            }
+            telnet_stored_header(out, n, 0);
+            seg->adler=adler32(seg->adler, out+5, (uInt)n);
+            seg->alen+=n;
+            out+=5+n;
+            data+=consumed;
+            len-=consumed;
+        }
+        need=out-(seg->data+seg->end);
+    } else
+#endif
+    if(escape) {
+        telnet_escape((char*)out, need, len, data, &consumed);
+    } else {
+        memcpy(out, data, len);
+    }
+    seg->end+=need;
+    q->pending+=need;
+    telnet_outq_water(q);
+    return 1;
+}
+
+/* queue text with every IAC doubled. small appends are coalesced into the
+ * last segment. returns 0 if out of memory, nothing is queued then.
+ */
+int telnet_outq_text(struct telnet_outq *q, size_t len, const char *text) {
+    assert(q != NULL);
+    return telnet_outq_put(q, len, text, 1);
+}
+
+/* queue bytes as they are, for commands from telnet_encode_xxx() */
+int telnet_outq_raw(struct telnet_outq *q, size_t len, const void *data) {
+    assert(q != NULL);
+    return telnet_outq_put(q, len, data, 0);
+}
+
+/* queue a frame by reference, the cost does not depend on its length.
+ * the queue takes its own reference and drops it once the frame is sent or
+ * discarded. returns 0 if out of memory.
+ */
+int telnet_outq_frame(struct telnet_outq *q, struct telnet_frame *f) {
+#ifdef JDM_TELNET_MCCP
+    struct telnet_outseg *seg;
+#endif
+
+    assert(q != NULL);
+    assert(f != NULL);
+    if(!f->len) return 1;
+#ifdef JDM_TELNET_MCCP
+    if(q->shared && f->zlen) {
+        seg=telnet_outq_ref(q, f, f->zdata, f->zlen);
+        if(!seg) return 0;
+        seg->adler=f->adler;
+        seg->alen=f->len;
+    } else if(q->shared) {
+        /* not compressed: stored blocks, still pointing into the frame */
+        unsigned char *hdr;
+        size_t pos, n;
+
+        for(pos=0;pos<f->len;pos+=n) {
+            n=f->len-pos<TELNET_STORED_MAX ? f->len-pos : TELNET_STORED_MAX;
+            seg=telnet_outq_room(q, 5);
+            if(!seg) return 0;
+            hdr=seg->data+seg->end;
+            telnet_stored_header(hdr, n, 0);
+            seg->end+=5;
+            q->pending+=5;
+            seg=telnet_outq_ref(q, f, f->data+pos, n);
+            if(!seg) return 0;
+            seg->adler=f->block_adler ? f->block_adler[pos/TELNET_STORED_MAX] : f->adler;
+            seg->alen=n;
+            seg->joined=1;
+        }
+    } else
+#endif
+    if(!telnet_outq_ref(q, f, f->data, f->len)) return 0;
+    telnet_outq_water(q);
+    return 1;
+}
+
+#ifdef JDM_TELNET_MCCP
+/* compress everything after this point with mc. queue telnet_mccp_start()
+ * with telnet_outq_raw() first. the stream is flushed with
+ * TelnetMccpSync whenever the queue runs empty, so the client never waits
+ * on data sitting in zlib. mc still belongs to the caller.
+ */
+void telnet_outq_setmccp(struct telnet_outq *q, struct telnet_mccp *mc) {
+    assert(!q->shared);
+    q->mc=mc;
+    q->zend=0;
+}
+
+/* compress everything after this point without any zlib state for this
+ * queue: frames go out as telnet_frame_compress() left them, everything
+ * else in stored blocks. for servers with many connections where most
+ * output is broadcast. queue telnet_mccp_start() first.
+ */
+void telnet_outq_setmccp_shared(struct telnet_outq *q) {
+    static const unsigned char zlib_header[2]={ 0x78, 0x01 };
+
+    assert(!q->mc);
+    telnet_outq_raw(q, 2, zlib_header);
+    q->shared=1;
+    q->adler=1;
+}
+
+/* end the compressed stream after what is queued so far, anything queued
+ * later is sent plain. returns 0 if out of memory.
+ */
+int telnet_outq_mccp_end(struct telnet_outq *q) {
+    struct telnet_outseg *seg;
+
+    if(q->shared) {
+        /* the adler32 is filled in later, so the trailer gets a segment of its own */
+        seg=malloc(sizeof(*seg)+9);
+        if(!seg) return 0;
+        q->shared=0;
+        seg->data=seg->buf;
+        seg->cap=9;
+        seg->frame=NULL;
+        seg->start=0;
+        telnet_outq_link(q, seg);
+        telnet_stored_header(seg->data, 0, 1);
+        seg->end=9;
+        seg->zend=TelnetOutqTrailer;
+        q->pending+=9;
+    } else if(q->mc && !q->zend) {
+        seg=malloc(sizeof(*seg));
+        if(!seg) return 0;
+        seg->data=seg->buf;
+        seg->start=seg->end=seg->cap=0;
+        seg->frame=NULL;
+        telnet_outq_link(q, seg);
+        seg->zend=TelnetOutqFinish;
+        q->zend=1;
+    }
+    telnet_outq_water(q);
+    return 1;
+}
+
+/* move compressed segments from the front of the queue through zlib into
+ * zseg, until zseg is full or the queue is empty and sync flushed.
+ */
+static void telnet_outq_deflate(struct telnet_outq *q) {
+    struct telnet_outseg *seg, *z=q->zseg;
+    size_t n, consumed, room;
+
+    if(!z) {
+        z=malloc(sizeof(*z)+q->seg_size);
+        if(!z) return;
+        z->next=NULL;
+        z->data=z->buf;
+        z->cap=q->seg_size;
+        z->compress=0;
+        z->frame=NULL;
+        q->zseg=z;
+    }
+    z->start=z->end=0;
+    while((room=z->cap-z->end)>0) {
+        seg=q->head;
+        if(seg && seg->zend==TelnetOutqFinish) {
+            n=telnet_mccp_compress(q->mc, z->data+z->end, room, 0, "", &consumed, TelnetMccpFinish);
+            z->end+=n;
+            if(n==room) continue; /* more of the end of stream to come */
+            q->head=seg->next;
+            if(!q->head) q->tail=NULL;
+            telnet_outq_release(q, seg);
+            q->mc=NULL;
+            q->zend=0;
+            q->zsync=0;
+            break;
+        }
+        if(!seg || !seg->compress) {
+            if(!q->zsync) break;
+            /* caught up: flush so the client can decode all of it */
+            n=telnet_mccp_compress(q->mc, z->data+z->end, room, 0, "", &consumed, TelnetMccpSync);
+            z->end+=n;
+            q->zsync=n==room;
+            continue;
+        }
+        n=telnet_mccp_compress(q->mc, z->data+z->end, room, seg->end-seg->start, (const char*)seg->data+seg->start,
+            &consumed, TelnetMccpNone);
+        z->end+=n;
+        seg->start+=consumed;
+        q->pending-=consumed;
+        q->zsync=1;
+        if(seg->start==seg->end) {
+            q->head=seg->next;
+            if(!q->head) q->tail=NULL;
+            telnet_outq_release(q, seg);
+        }
+    }
+    q->pending+=z->end;
+}
+
+/* the adler32 of the stream is known once everything before it was sent */
+static void telnet_outq_trailer(struct telnet_outq *q, struct telnet_outseg *seg) {
+    unsigned char *p=seg->data+5;
+
+    p[0]=(unsigned char)(q->adler>>24);
+    p[1]=(unsigned char)(q->adler>>16);
+    p[2]=(unsigned char)(q->adler>>8);
+    p[3]=(unsigned char)q->adler;
+}
+#endif
+
+/* describe the next bytes to send, oldest first, without taking them off
+ * the queue. with MCCP on this is where queued data is compressed.
+ * returns the number of entries used, 0 when there is nothing to send.
+ */
+int telnet_outq_peek(struct telnet_outq *q, struct iovec *iov, int iov_max) {
+    struct telnet_outseg *seg;
+    int n=0;
+
+    assert(q != NULL);
+#ifdef JDM_TELNET_MCCP
+    if(q->zseg && q->zseg->start<q->zseg->end) {
+        if(iov_max<1) return 0;
+        iov[0].iov_base=q->zseg->data+q->zseg->start;
+        iov[0].iov_len=q->zseg->end-q->zseg->start;
+        return 1;
+    }
+    if(q->head ? q->head->compress : q->zsync) {
+        telnet_outq_deflate(q);
+        if(q->zseg && q->zseg->start<q->zseg->end) return telnet_outq_peek(q, iov, iov_max);
+    }
+#endif
+    for(seg=q->head;seg && n<iov_max && !seg->compress;seg=seg->next) {
+#ifdef JDM_TELNET_MCCP
+        if(seg->zend==TelnetOutqTrailer) {
+            if(seg!=q->head) break;
+            telnet_outq_trailer(q, seg);
+        }
+#endif
+        iov[n].iov_base=seg->data+seg->start;
+        iov[n].iov_len=seg->end-seg->start;
+        n++;
+    }
+    return n;
+}
+
+/* take n bytes that were sent off the front of the queue */
+void telnet_outq_consume(struct telnet_outq *q, size_t n) {
+    struct telnet_outseg *seg;
+    size_t take;
+
+    assert(q != NULL);
+    assert(n <= q->pending);
+    q->pending-=n;
+    if(q->zseg && q->zseg->start<q->zseg->end) {
+        /* peek() never mixes compressed and queued bytes */
+        q->zseg->start+=n;
+        n=0;
+#ifdef JDM_TELNET_MCCP
+        /* an owed sync flush keeps pending non-zero until it is sent */
+        if(q->zseg->start==q->zseg->end && q->zsync && !q->head) telnet_outq_deflate(q);
+#endif
+    }
+    while(n && (seg=q->head)) {
+        take=seg->end-seg->start;
+        if(take>n) take=n;
+        seg->start+=take;
+        n-=take;
+        if(seg->start==seg->end) {
+#ifdef JDM_TELNET_MCCP
+            if(seg->alen) q->adler=adler32_combine(q->adler, seg->adler, (z_off_t)seg->alen);
+#endif
+            q->head=seg->next;
+            if(!q->head) q->tail=NULL;
+            telnet_outq_release(q, seg);
+        }
+    }
+    telnet_outq_water(q);
+}
+
+/* write as much as the socket takes, one writev() per batch of segments.
+ * returns the number of bytes written, 0 when fd would block, or -1 with
+ * errno set on an error. anything not written stays queued.
+ */
+ssize_t telnet_outq_flush(struct telnet_outq *q, int fd) {
+    struct iovec iov[16];
+    ssize_t total=0, w;
+    size_t want;
+    int i, n;
+
+    while((n=telnet_outq_peek(q, iov, 16))>0) {
+        for(want=0, i=0;i<n;i++) want+=iov[i].iov_len;
+        w=writev(fd, iov, n);
+        if(w<0) {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) break;
+            return -1;
+        }
+        telnet_outq_consume(q, (size_t)w);
+        total+=w;
+        if((size_t)w<want) break; /* the socket buffer is full */
+    }
+    return total;
+}
+
+/* bytes waiting to be written */
+size_t telnet_outq_pending(const struct telnet_outq *q) {
+    return q->pending;
+}
+
+/* true from going over the high watermark until back at the low one */
+int telnet_outq_throttled(const struct telnet_outq *q) {
+    return q->throttled;
+}
+
+/* drop queued output, for IAC AO and IAC IP. a segment that was partly
+ * written is kept so nothing is cut in the middle, and so is output that
+ * was already compressed and the end of an MCCP stream, as the client
+ * depends on them. a stored block of a frame goes with its header.
+ */
+void telnet_outq_discard(struct telnet_outq *q) {
+    struct telnet_outseg *seg, *next, *first, **link;
+    int keep, kept=1; /* everything before the head was sent */
+
+    assert(q != NULL);
+    first=q->head;
+    q->head=q->tail=NULL;
+    link=&q->head;
+    for(seg=first;seg;seg=next) {
+        next=seg->next;
+        keep=seg->zend || (seg==first && seg->start>0 && !seg->compress) || (seg->joined && kept);
+        kept=keep;
+        if(keep) {
+            seg->next=NULL;
+            *link=seg;
+            link=&seg->next;
+            q->tail=seg;
+            continue;
+        }
+        q->pending-=seg->end-seg->start;
+        telnet_outq_release(q, seg);
+    }
+#ifdef JDM_TELNET_MCCP
+    /* zlib may hold back input it already took, the client needs it */
+    if(q->zsync && !(q->zseg && q->zseg->start<q->zseg->end)) telnet_outq_deflate(q);
+#endif
+    telnet_outq_water(q);
+}
 #endif /* JDM_TELNET_IMPLEMENTATION */
 #endif /* JDM_TELNET_H_ */
@@ -0,0 +1,193 @@
+/* PUBLIC DOMAIN - jdm_telnet C++ front end */
+/* USAGE:
+ *
+ * Needs C++17. Build jdm_telnet.h with JDM_TELNET_IMPLEMENTATION in one C
+ * source file as usual, then include this header from C++.
+ *
+ * Derive a handler from jdm::telnet_parser<Handler> and define the
+ * callbacks it cares about, the rest do nothing:
+ *
+ *   struct session : jdm::telnet_parser<session> {
+ *       void on_text(std::string_view text);
+ *       void on_command(unsigned char command);
+ *       void on_negotiate(unsigned char command, unsigned char option);
+ *       void on_subneg(unsigned char option, std::string_view payload, int chunk);
+ *       void on_naws(const telnet_naws &naws);
+ *       void on_ttype(std::string_view name);
+ *       void on_environ(int qual, telnet_sbiter it);
+ *       void on_slc(telnet_sbiter it);
+ *   };
+ *
+ * then feed() it every buffer that is read. the callbacks are found at
+ * compile time, so they are inlined into the loop over the events of
+ * telnet_parse_batch() that is instantiated for each handler.
+ *
+ * complete SB frames of NAWS, TTYPE IS, NEW-ENVIRON and LINEMODE SLC go
+ * to their own callback, picked by the subneg_table entry of the option.
+ * a handler can replace the table with its own static constexpr
+ * subneg_table, e.g. one from jdm::telnet_subneg_table() with entries
+ * set to jdm::telnet_subneg::raw to see those frames in on_subneg().
+ * pieces of a frame that did not fit the SB buffer always go to
+ * on_subneg(), chunk has the enum telnet_sbchunk bits of the piece.
+ *
+ * the parser owns its telnet_info and can be moved but not copied.
+ */
+#ifndef JDM_TELNET_HPP_
+#define JDM_TELNET_HPP_
+#include "jdm_telnet.h"
+
+#include <arpa/telnet.h>
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <string_view>
+#include <utility>
+
+namespace jdm {
+
+/* how a complete SB frame is decoded before it reaches the handler */
+enum class telnet_subneg : unsigned char {
+    raw,                        /* on_subneg() */
+    naws,                       /* on_naws() */
+    ttype,                      /* on_ttype() for TTYPE IS */
+    environ,                    /* on_environ() for NEW-ENVIRON IS/SEND/INFO */
+    slc,                        /* on_slc() for LINEMODE SLC */
+};
+
+using telnet_subneg_map = std::array<telnet_subneg, 256>;
+
+/* the decoders jdm_telnet.h has, everything else raw */
+constexpr telnet_subneg_map telnet_subneg_table() {
+    telnet_subneg_map t{};
+    t[TELOPT_NAWS]=telnet_subneg::naws;
+    t[TELOPT_TTYPE]=telnet_subneg::ttype;
+    t[TELOPT_NEW_ENVIRON]=telnet_subneg::environ;
+    t[TELOPT_LINEMODE]=telnet_subneg::slc;
+    return t;
+}
+
+template<class Handler, std::size_t ExtraMax=0>
+class telnet_parser {
+public:
+    static constexpr telnet_subneg_map subneg_table=telnet_subneg_table();
+
+    telnet_parser() : ts_(telnet_create(ExtraMax)) {
+        if(!ts_) throw std::bad_alloc();
+    }
+    ~telnet_parser() {
+        telnet_free(ts_);
+    }
+    telnet_parser(const telnet_parser&)=delete;
+    telnet_parser &operator=(const telnet_parser&)=delete;
+    telnet_parser(telnet_parser &&other) noexcept : ts_(std::exchange(other.ts_, nullptr)) {}
+    telnet_parser &operator=(telnet_parser &&other) noexcept {
+        std::swap(ts_, other.ts_);
+        return *this;
+    }
+
+    /* the state, for the C functions that have no wrapper */
+    telnet_info *get() const noexcept { return ts_; }
+    void setflags(int flags) noexcept { telnet_setflags(ts_, flags); }
+    int getflags() const noexcept { return telnet_getflags(ts_); }
+
+    /* parse one buffer. returns false if it could not all be parsed */
+    bool feed(const char *buf, std::size_t len) {
+        telnet_begin(ts_, len, buf);
+        return run(buf, nullptr);
+    }
+    bool feed(std::string_view buf) {
+        return feed(buf.data(), buf.size());
+    }
+    /* parse a list of buffers as one stream, see telnet_beginv() */
+    bool feed(const struct iovec *iov, int iovcnt) {
+        telnet_beginv(ts_, iov, iovcnt);
+        return run(nullptr, iov);
+    }
+
+    /* the defaults, hidden by the handler's own */
+    void on_text(std::string_view) {}
+    void on_command(unsigned char) {}
+    void on_negotiate(unsigned char, unsigned char) {}
+    void on_subneg(unsigned char, std::string_view, int) {}
+    void on_naws(const telnet_naws&) {}
+    void on_ttype(std::string_view) {}
+    void on_environ(int, telnet_sbiter) {}
+    void on_slc(telnet_sbiter) {}
+
+private:
+    telnet_info *ts_;
+
+    Handler &self() noexcept { return static_cast<Handler&>(*this); }
+
+    /* text is in buf, or in iov[seg] */
+    bool run(const char *buf, const struct iovec *iov) {
+        telnet_event ev[64];
+        int i, n;
+
+        while(telnet_continue(ts_)) {
+            n=telnet_parse_batch(ts_, ev, 64);
+            for(i=0;i<n;i++) dispatch(ev[i], buf, iov);
+        }
+        return telnet_end(ts_);
+    }
+
+    void dispatch(const telnet_event &ev, const char *buf, const struct iovec *iov) {
+        switch(ev.type) {
+            case TelnetEventText:
+                if(ev.extra) {
+                    self().on_text(std::string_view(reinterpret_cast<const char*>(ev.extra), ev.len));
+                } else {
+                    const char *base=iov ? static_cast<const char*>(iov[ev.seg].iov_base) : buf;
+                    self().on_text(std::string_view(base+ev.offset, ev.len));
+                }
+                break;
+            case TelnetEventCommand:
+                self().on_command(ev.command);
+                break;
+            case TelnetEventNegotiate:
+                self().on_negotiate(ev.command, ev.option);
+                break;
+            case TelnetEventSubneg:
+                subneg(ev);
+                break;
+        }
+    }
+
+    void subneg(const telnet_event &ev) {
+        telnet_naws naws;
+        telnet_sbiter it;
+        const char *name;
+        std::size_t name_len;
+        int qual;
+
+        if(ev.flags==(TelnetSbBegin|TelnetSbEnd)) {
+            switch(Handler::subneg_table[ev.option]) {
+                case telnet_subneg::raw:
+                    break;
+                case telnet_subneg::naws:
+                    if(!telnet_decode_naws(ev.len, ev.extra, &naws)) break;
+                    self().on_naws(naws);
+                    return;
+                case telnet_subneg::ttype:
+                    if(!telnet_decode_ttype(ev.len, ev.extra, &name, &name_len)) break;
+                    self().on_ttype(std::string_view(name, name_len));
+                    return;
+                case telnet_subneg::environ:
+                    qual=telnet_environ_begin(&it, ev.len, ev.extra);
+                    if(qual<0) break;
+                    self().on_environ(qual, it);
+                    return;
+                case telnet_subneg::slc:
+                    if(!telnet_slc_begin(&it, ev.len, ev.extra)) break;
+                    self().on_slc(it);
+                    return;
+            }
+        }
+        self().on_subneg(ev.option, std::string_view(reinterpret_cast<const char*>(ev.extra), ev.len), ev.flags);
+    }
+};
+
+}
+
+#endif /* JDM_TELNET_HPP_ */
@@ -0,0 +1,523 @@
+/****************************** LOAD GENERATOR *******************************/
+
+#define JDM_TELNET_IMPLEMENTATION
+#include "jdm_telnet.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/* USAGE:
+ *  loadgen_telnet [-h host] [-p port] [-c clients] [-r rate] [-d seconds]
+ *                 [-i interval] [-l line] [-P prompt] [-S sources]
+ *
+ *  opens clients telnet connections and has each of them send a command
+ *  line every interval, measuring how long the server takes to answer.
+ *  every client offers TTYPE, NAWS and NEW-ENVIRON and answers the server's
+ *  questions about them the way a terminal would, so the server sees a
+ *  realistic login handshake. all input is decoded with jdm_telnet.
+ *
+ *  -h host      server address (default 127.0.0.1)
+ *  -p port      server port (default 3000)
+ *  -c clients   number of connections (default 100)
+ *  -r rate      connections opened per second, 0 for as fast as possible
+ *               (default 0)
+ *  -d seconds   how long to run after the first connect (default 10)
+ *  -i interval  milliseconds between lines of one client (default 1000).
+ *               a client has one line outstanding at a time, a late answer
+ *               delays its next line.
+ *  -l line      the command line to send (default "look")
+ *  -P prompt    a line is answered when this text comes back. without it
+ *               every line is followed by IAC DO TIMING-MARK (RFC 860),
+ *               which any server answers with WILL or WONT TIMING-MARK once
+ *               it has read the line.
+ *  -S sources   spread connections over this many local addresses,
+ *               127.0.0.1 and up, for more than one address worth of
+ *               ephemeral ports over loopback (default 1)
+ *
+ *  prints connects per second, the number of lines answered after the
+ *  next one was due, and percentiles of the connect time and of the line
+ *  round trip.
+ */
+
+#define READ_BUF_SIZE (64*1024)
+#define OUT_SIZE 512            /* unsent bytes kept per client */
+#define MAX_EVENTS 256
+#define OPEN_BURST 256          /* connects started per loop iteration */
+
+enum client_state {
+    ClientFree,
+    ClientConnecting,
+    ClientOpen,
+};
+
+struct client {
+    int fd;
+    enum client_state state;
+    struct telnet_info *ts;
+    double connect_start;
+    double sent;                /* when the outstanding line went out, 0 if none */
+    double due;                 /* when the next line should go */
+    size_t prompt_match;        /* bytes of the prompt seen so far */
+    size_t out_len;
+    unsigned char out[OUT_SIZE];
+};
+
+/* latency samples in microseconds */
+struct samples {
+    unsigned *v;
+    size_t n, cap;
+};
+
+/* min-heap of clients by due time */
+struct timers {
+    int *idx;
+    int n;
+};
+
+static struct client *clients;
+static struct timers timers;
+static struct samples rtt, connect_time;
+static const char *line="look";
+static const char *prompt;
+static double interval=1.0;
+static unsigned long errors, late, bytes_in;
+static char *buf;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+static void sample_add(struct samples *s, double seconds) {
+    if(s->n==s->cap) {
+        s->cap=s->cap ? s->cap*2 : 4096;
+        s->v=realloc(s->v, s->cap*sizeof(*s->v));
+        if(!s->v) {
+            perror("realloc()");
+            exit(1);
+        }
+    }
+    s->v[s->n++]=(unsigned)(seconds*1e6);
+}
+
+static int sample_cmp(const void *a, const void *b) {
+    unsigned x=*(const unsigned*)a, y=*(const unsigned*)b;
+    return x<y ? -1 : x>y;
+}
+
+static void sample_print(const char *title, struct samples *s) {
+    if(!s->n) {
+        printf("%-8s no samples\n", title);
+        return;
+    }
+    qsort(s->v, s->n, sizeof(*s->v), sample_cmp);
+    printf("%-8s %8lu samples  p50 %8u us  p99 %8u us  p999 %8u us  max %8u us\n",
+        title, (unsigned long)s->n, s->v[s->n/2], s->v[s->n*99/100],
+        s->v[s->n*999/1000], s->v[s->n-1]);
+}
+
+static int timer_before(int a, int b) {
+    return clients[timers.idx[a]].due<clients[timers.idx[b]].due;
+}
+
+static void timer_swap(int a, int b) {
+    int t=timers.idx[a];
+    timers.idx[a]=timers.idx[b];
+    timers.idx[b]=t;
+}
+
+static void timer_push(int i) {
+    int pos=timers.n++;
+
+    timers.idx[pos]=i;
+    while(pos>0 && timer_before(pos, (pos-1)/2)) {
+        timer_swap(pos, (pos-1)/2);
+        pos=(pos-1)/2;
+    }
+}
+
+static int timer_pop(void) {
+    int top=timers.idx[0], pos=0, child;
+
+    timers.idx[0]=timers.idx[--timers.n];
+    for(;;) {
+        child=2*pos+1;
+        if(child>=timers.n) break;
+        if(child+1<timers.n && timer_before(child+1, child)) child++;
+        if(!timer_before(child, pos)) break;
+        timer_swap(pos, child);
+        pos=child;
+    }
+    return top;
+}
+
+static void client_close(struct client *cl) {
+    close(cl->fd);
+    telnet_free(cl->ts);
+    cl->ts=NULL;
+    cl->state=ClientFree;
+}
+
+static void client_flush(struct client *cl) {
+    ssize_t n;
+
+    while(cl->out_len) {
+        n=send(cl->fd, cl->out, cl->out_len, MSG_NOSIGNAL);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN) {
+                errors++;
+                client_close(cl);
+            }
+            return;
+        }
+        memmove(cl->out, cl->out+n, cl->out_len-n);
+        cl->out_len-=n;
+    }
+}
+
+/* queue bytes, written on the next client_flush() */
+static void client_put(struct client *cl, size_t len, const void *data) {
+    if(len>OUT_SIZE-cl->out_len) {
+        errors++; /* the server is not reading */
+        return;
+    }
+    memcpy(cl->out+cl->out_len, data, len);
+    cl->out_len+=len;
+}
+
+/* the server asked for something a terminal would tell it */
+static void client_subneg(struct client *cl, size_t len, const unsigned char *sb) {
+    static const unsigned char ttype[]={ TELQUAL_IS, 'x', 't', 'e', 'r', 'm', '-', '2', '5', '6', 'c', 'o', 'l', 'o', 'r' };
+    static const unsigned char env[]={ TELQUAL_IS,
+        NEW_ENV_VAR, 'U', 'S', 'E', 'R', NEW_ENV_VALUE, 'l', 'o', 'a', 'd', 'g', 'e', 'n',
+        ENV_USERVAR, 'C', 'O', 'L', 'O', 'R', 'T', 'E', 'R', 'M', NEW_ENV_VALUE, 't', 'r', 'u', 'e', 'c', 'o', 'l', 'o', 'r' };
+    struct telnet_sbiter it;
+    unsigned char out[64];
+    size_t n=0;
+
+    if(len==2 && sb[0]==TELOPT_TTYPE && sb[1]==TELQUAL_SEND) {
+        n=telnet_encode_subneg(out, sizeof(out), TELOPT_TTYPE, sizeof(ttype), ttype);
+    } else if(telnet_environ_begin(&it, len, sb)==TELQUAL_SEND) {
+        n=telnet_encode_subneg(out, sizeof(out), TELOPT_NEW_ENVIRON, sizeof(env), env);
+    }
+    client_put(cl, n, out);
+}
+
+/* the answer to the outstanding line arrived. it is late if the next
+ * line was already due.
+ */
+static void client_answered(struct client *cl, int i, double t) {
+    if(!cl->sent) return;
+    sample_add(&rtt, t-cl->sent);
+    if(t>cl->sent+interval) late++;
+    cl->due=cl->sent+interval;
+    cl->sent=0;
+    timer_push(i);
+}
+
+/* look for the prompt in text that may be cut anywhere */
+static void client_text(struct client *cl, int i, size_t len, const char *text, double t) {
+    size_t plen=strlen(prompt), k;
+
+    for(k=0;k<len;k++) {
+        if(text[k]==prompt[cl->prompt_match]) {
+            cl->prompt_match++;
+        } else {
+            cl->prompt_match=text[k]==prompt[0];
+        }
+        if(cl->prompt_match==plen) {
+            cl->prompt_match=0;
+            client_answered(cl, i, t);
+        }
+    }
+}
+
+static void client_input(struct client *cl, int i, size_t len, double t) {
+    struct telnet_event ev[64];
+    static const unsigned char naws[]={ 0, 80, 0, 24 }; /* 80x24 */
+    unsigned char out[32];
+    size_t n;
+    int k, count;
+
+    telnet_begin(cl->ts, len, buf);
+    while(telnet_continue(cl->ts)) {
+        count=telnet_parse_batch(cl->ts, ev, 64);
+        for(k=0;k<count;k++) {
+            switch(ev[k].type) {
+                case TelnetEventText:
+                    if(prompt) {
+                        client_text(cl, i, ev[k].len, ev[k].extra ? (const char*)ev[k].extra : buf+ev[k].offset, t);
+                    }
+                    break;
+                case TelnetEventNegotiate:
+                    if(ev[k].option==TELOPT_TM && (ev[k].command==WILL || ev[k].command==WONT)) {
+                        if(!prompt) client_answered(cl, i, t);
+                        break;
+                    }
+                    n=telnet_q_receive(cl->ts, ev[k].command, ev[k].option, out);
+                    if(ev[k].command==DO && ev[k].option==TELOPT_NAWS && telnet_q_enabled_us(cl->ts, TELOPT_NAWS)) {
+                        n+=telnet_encode_subneg(out+n, sizeof(out)-n, TELOPT_NAWS, sizeof(naws), naws);
+                    }
+                    client_put(cl, n, out);
+                    break;
+                case TelnetEventSubneg:
+                    client_subneg(cl, ev[k].len, ev[k].extra);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    telnet_end(cl->ts);
+}
+
+static void client_read(struct client *cl, int i) {
+    ssize_t n;
+
+    while(cl->state==ClientOpen) {
+        n=recv(cl->fd, buf, READ_BUF_SIZE, 0);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN) {
+                errors++;
+                client_close(cl);
+            }
+            return;
+        }
+        if(n==0) {
+            errors++; /* the server hung up */
+            client_close(cl);
+            return;
+        }
+        bytes_in+=n;
+        client_input(cl, i, n, now());
+    }
+}
+
+/* the connect finished: start the handshake and the line schedule */
+static void client_connected(struct client *cl, int i, double t) {
+    unsigned char out[16];
+    size_t n;
+    int err=0;
+    socklen_t errlen=sizeof(err);
+
+    if(getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+        errors++;
+        client_close(cl);
+        return;
+    }
+    sample_add(&connect_time, t-cl->connect_start);
+    cl->state=ClientOpen;
+    telnet_q_allow(cl->ts, TELOPT_TTYPE, 1, 0);
+    telnet_q_allow(cl->ts, TELOPT_NAWS, 1, 0);
+    telnet_q_allow(cl->ts, TELOPT_NEW_ENVIRON, 1, 0);
+    telnet_q_allow(cl->ts, TELOPT_SGA, 1, 1);
+    telnet_q_allow(cl->ts, TELOPT_ECHO, 0, 1);
+    n=telnet_q_request_us(cl->ts, TELOPT_TTYPE, 1, out);
+    n+=telnet_q_request_us(cl->ts, TELOPT_NAWS, 1, out+n);
+    n+=telnet_q_request_us(cl->ts, TELOPT_NEW_ENVIRON, 1, out+n);
+    client_put(cl, n, out);
+    /* spread the first lines over one interval */
+    cl->due=t+interval*(rand()/(RAND_MAX+1.0));
+    timer_push(i);
+}
+
+/* send the next line of a client whose time has come. a client waiting
+ * for an answer is not on the heap, so none is outstanding.
+ */
+static void client_send_line(struct client *cl, double t) {
+    unsigned char out[OUT_SIZE];
+    size_t n, consumed;
+
+    if(cl->state!=ClientOpen) return;
+    n=telnet_escape((char*)out, sizeof(out)-5, strlen(line), line, &consumed);
+    out[n++]='\r';
+    out[n++]='\n';
+    if(!prompt) n+=telnet_encode_option(out+n, DO, TELOPT_TM);
+    client_put(cl, n, out);
+    client_flush(cl);
+    cl->sent=t;
+}
+
+static int client_open(int epfd, struct client *cl, int i, const struct sockaddr_in *to, int sources) {
+    struct epoll_event ev;
+    struct sockaddr_in from;
+    int one=1;
+
+    cl->fd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(cl->fd<0) {
+        perror("socket()");
+        return -1;
+    }
+    setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(sources>1) {
+        memset(&from, 0, sizeof(from));
+        from.sin_family=AF_INET;
+        from.sin_addr.s_addr=htonl(INADDR_LOOPBACK+i%sources);
+        if(bind(cl->fd, (struct sockaddr*)&from, sizeof(from))) perror("bind()");
+    }
+    cl->ts=telnet_create(0);
+    if(!cl->ts) {
+        perror("telnet_create()");
+        close(cl->fd);
+        return -1;
+    }
+    cl->state=ClientConnecting;
+    cl->sent=0;
+    cl->prompt_match=0;
+    cl->out_len=0;
+    cl->connect_start=now();
+    if(connect(cl->fd, (const struct sockaddr*)to, sizeof(*to)) && errno!=EINPROGRESS) {
+        errors++;
+        client_close(cl);
+        return 0;
+    }
+    ev.events=EPOLLIN|EPOLLOUT|EPOLLET;
+    ev.data.u32=i;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, cl->fd, &ev)) {
+        perror("epoll_ctl()");
+        client_close(cl);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct epoll_event events[MAX_EVENTS];
+    struct sockaddr_in to;
+    struct rlimit rl;
+    const char *host="127.0.0.1";
+    double rate=0, duration=10, start, t, last_connect=0, wait;
+    int port=3000, nclients=100, sources=1, opened=0, connected=0;
+    int c, i, n, epfd, burst;
+
+    while((c=getopt(argc, argv, "h:p:c:r:d:i:l:P:S:"))!=-1) {
+        switch(c) {
+            case 'h':
+                host=optarg;
+                break;
+            case 'p':
+                port=atoi(optarg);
+                break;
+            case 'c':
+                nclients=atoi(optarg);
+                break;
+            case 'r':
+                rate=atof(optarg);
+                break;
+            case 'd':
+                duration=atof(optarg);
+                break;
+            case 'i':
+                interval=atof(optarg)/1000;
+                break;
+            case 'l':
+                line=optarg;
+                break;
+            case 'P':
+                prompt=*optarg ? optarg : NULL;
+                break;
+            case 'S':
+                sources=atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-r rate] [-d seconds]\n"
+                    "       [-i interval] [-l line] [-P prompt] [-S sources]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(nclients<1) nclients=1;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family=AF_INET;
+    to.sin_port=htons(port);
+    if(inet_pton(AF_INET, host, &to.sin_addr)!=1) {
+        fprintf(stderr, "%s: not an IPv4 address\n", host);
+        return 1;
+    }
+
+    /* a descriptor per client, plus a few */
+    if(!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur<(rlim_t)nclients+16) {
+        rl.rlim_cur=rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur<(rlim_t)nclients+16) {
+            fprintf(stderr, "only %lu file descriptors, raise ulimit -n\n", (unsigned long)rl.rlim_cur);
+        }
+    }
+
+    clients=calloc(nclients, sizeof(*clients));
+    timers.idx=malloc(nclients*sizeof(*timers.idx));
+    buf=malloc(READ_BUF_SIZE);
+    epfd=epoll_create1(EPOLL_CLOEXEC);
+    if(!clients || !timers.idx || !buf || epfd<0) {
+        perror("setup");
+        return 1;
+    }
+
+    start=now();
+    for(t=start;t<start+duration;t=now()) {
+        /* connects, paced by rate */
+        burst=OPEN_BURST;
+        while(opened<nclients && burst-- && (!rate || opened<rate*(t-start))) {
+            if(client_open(epfd, &clients[opened], opened, &to, sources)) return 1;
+            opened++;
+        }
+
+        wait=timers.n ? clients[timers.idx[0]].due-t : 0.1;
+        if(opened<nclients) wait=0.001;
+        if(wait<0) wait=0;
+        n=epoll_wait(epfd, events, MAX_EVENTS, (int)(wait*1000+0.999));
+        if(n<0 && errno!=EINTR) {
+            perror("epoll_wait()");
+            return 1;
+        }
+        t=now();
+        for(i=0;i<n;i++) {
+            struct client *cl=&clients[events[i].data.u32];
+
+            if(cl->state==ClientConnecting && (events[i].events&(EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+                client_connected(cl, events[i].data.u32, t);
+                if(cl->state==ClientOpen) {
+                    connected++;
+                    last_connect=t;
+                }
+            }
+            if(cl->state==ClientOpen && (events[i].events&EPOLLIN)) client_read(cl, events[i].data.u32);
+            if(cl->state==ClientOpen) client_flush(cl);
+        }
+
+        /* lines that are due */
+        while(timers.n && clients[timers.idx[0]].due<=t) {
+            i=timer_pop();
+            client_send_line(&clients[i], t);
+        }
+    }
+
+    printf("%d of %d clients connected", connected, nclients);
+    if(connected>1 && last_connect>start) {
+        printf(", %.0f connects/s", connected/(last_connect-start));
+    }
+    printf(", %lu errors, %lu late lines, %lu bytes received\n", errors, late, bytes_in);
+    sample_print("connect", &connect_time);
+    sample_print("rtt", &rtt);
+
+    for(i=0;i<opened;i++) {
+        if(clients[i].state!=ClientFree) client_close(&clients[i]);
+    }
+    close(epfd);
+    free(clients);
+    free(timers.idx);
+    free(buf);
+    free(rtt.v);
+    free(connect_time.v);
+    return 0;
+}
@@ -0,0 +1,326 @@
+/******************************* TRACE REPLAY ********************************/
+
+#define JDM_TELNET_IMPLEMENTATION
+#define JDM_TELNET_TRACE
+#include "jdm_telnet.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* USAGE:
+ *  replay_telnet [-c] [-n passes] trace
+ *
+ *  feeds a trace written by telnet_settrace() (example -T) through the
+ *  parser as fast as it goes. every connection gets its own state, and
+ *  every read is given to telnet_begin() or telnet_beginv() with the same
+ *  boundaries it had when it was recorded, so the fragmentation and the
+ *  mix of text and commands are those of the real clients.
+ *
+ *  -c         use telnet_gettext()/telnet_getcontrol() instead of
+ *             telnet_parse_batch()
+ *  -n passes  replay the trace this many times (default 1)
+ *
+ *  prints the throughput, then a histogram of the time each read took and
+ *  one of that time divided by the events the read produced.
+ */
+
+#define MAX_IOV 64
+#define HIST_BUCKETS 32 /* powers of 2 nanoseconds */
+
+struct conn {
+    uint32_t id;
+    struct telnet_info *ts;     /* NULL if the slot is free */
+};
+
+/* open addressing, the table is kept at most half full */
+struct conn_table {
+    struct conn *slots;
+    size_t mask;
+    size_t used;
+};
+
+struct hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long total;
+};
+
+/* what the replay measured, over all passes */
+struct totals {
+    unsigned long long bytes, events, reads;
+    double elapsed;
+    struct hist per_read, per_event;
+};
+
+static int classic;
+static unsigned long long checksum; /* keeps results live */
+
+static struct conn *conn_find(struct conn_table *t, uint32_t id) {
+    size_t i=(id*2654435761u)&t->mask;
+
+    while(t->slots[i].ts && t->slots[i].id!=id) i=(i+1)&t->mask;
+    return &t->slots[i];
+}
+
+static void conn_grow(struct conn_table *t) {
+    struct conn_table bigger;
+    size_t i;
+
+    bigger.mask=t->mask*2+1;
+    bigger.used=t->used;
+    bigger.slots=calloc(bigger.mask+1, sizeof(*bigger.slots));
+    if(!bigger.slots) {
+        perror("calloc()");
+        exit(1);
+    }
+    for(i=0;i<=t->mask;i++) {
+        if(t->slots[i].ts) *conn_find(&bigger, t->slots[i].id)=t->slots[i];
+    }
+    free(t->slots);
+    *t=bigger;
+}
+
+/* the state of a connection, a fresh one if start is set */
+static struct telnet_info *conn_get(struct conn_table *t, uint32_t id, int start) {
+    struct conn *c=conn_find(t, id);
+
+    if(c->ts && !start) return c->ts;
+    if(c->ts) {
+        telnet_free(c->ts);
+    } else {
+        t->used++;
+    }
+    c->id=id;
+    c->ts=telnet_create(0);
+    if(!c->ts) {
+        perror("telnet_create()");
+        exit(1);
+    }
+    if(t->used*2>t->mask) {
+        conn_grow(t);
+        c=conn_find(t, id);
+    }
+    return c->ts;
+}
+
+static void conn_free_all(struct conn_table *t) {
+    size_t i;
+
+    for(i=0;i<=t->mask;i++) {
+        telnet_free(t->slots[i].ts);
+        t->slots[i].ts=NULL;
+    }
+    t->used=0;
+}
+
+static void hist_add(struct hist *h, unsigned long long ns) {
+    unsigned b=0;
+
+    while(ns>1 && b<HIST_BUCKETS-1) {
+        ns>>=1;
+        b++;
+    }
+    h->count[b]++;
+    h->total++;
+}
+
+/* smallest power of 2 that at least q of the samples are below */
+static unsigned long long hist_quantile(const struct hist *h, double q) {
+    unsigned long seen=0;
+    unsigned b;
+
+    for(b=0;b<HIST_BUCKETS;b++) {
+        seen+=h->count[b];
+        if(seen>=q*h->total) break;
+    }
+    return 2ull<<b;
+}
+
+static void hist_print(const char *title, const struct hist *h) {
+    unsigned b, lo=HIST_BUCKETS, hi=0;
+    unsigned long most=1;
+    int bar;
+
+    printf("\n%s: p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns\n", title,
+        hist_quantile(h, 0.5), hist_quantile(h, 0.99), hist_quantile(h, 0.999));
+    for(b=0;b<HIST_BUCKETS;b++) {
+        if(!h->count[b]) continue;
+        if(b<lo) lo=b;
+        hi=b;
+        if(h->count[b]>most) most=h->count[b];
+    }
+    for(b=lo;b<=hi && lo<HIST_BUCKETS;b++) {
+        bar=(int)(h->count[b]*50/most);
+        printf("  < %10llu ns %10lu %.*s\n", 2ull<<b, h->count[b], bar,
+            "**************************************************");
+    }
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+/* parse what was given to telnet_begin(), return the number of events */
+static size_t replay_read(struct telnet_info *ts, const struct iovec *iov, int iovcnt) {
+    struct telnet_event ev[64];
+    size_t events=0;
+    int i, n;
+
+    if(iovcnt==1) {
+        telnet_begin(ts, iov[0].iov_len, iov[0].iov_base);
+    } else {
+        telnet_beginv(ts, iov, iovcnt);
+    }
+    while(telnet_continue(ts)) {
+        if(classic) {
+            const char *text;
+            size_t text_len, exlen;
+            const unsigned char *ex;
+            unsigned char cmd, opt;
+
+            if(telnet_gettext(ts, &text_len, &text) && text_len) {
+                checksum+=text_len;
+                events++;
+            }
+            if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+                checksum+=cmd+opt+exlen;
+                events++;
+            }
+        } else {
+            n=telnet_parse_batch(ts, ev, 64);
+            for(i=0;i<n;i++) {
+                checksum+=ev[i].len+ev[i].command;
+            }
+            events+=n;
+        }
+    }
+    telnet_end(ts);
+    return events;
+}
+
+/* replay one read of connection id and account for it */
+static void replay_flush(struct conn_table *conns, uint32_t id, const struct iovec *iov, int iovcnt, struct totals *t) {
+    struct telnet_info *ts=conn_get(conns, id, 0);
+    double t0, t1;
+    size_t n;
+    int i;
+
+    t0=now();
+    n=replay_read(ts, iov, iovcnt);
+    t1=now();
+    t->elapsed+=t1-t0;
+    hist_add(&t->per_read, (unsigned long long)((t1-t0)*1e9));
+    if(n) hist_add(&t->per_event, (unsigned long long)((t1-t0)*1e9/n));
+    for(i=0;i<iovcnt;i++) t->bytes+=iov[i].iov_len;
+    t->events+=n;
+    t->reads++;
+}
+
+int main(int argc, char **argv) {
+    struct telnet_trace_record rec;
+    struct conn_table conns;
+    struct totals t;
+    struct iovec iov[MAX_IOV];
+    struct stat st;
+    const unsigned char *map, *p, *end;
+    unsigned long long first_ns=0, last_ns=0;
+    unsigned long records=0;
+    uint32_t pending=0;         /* connection the buffers in iov belong to */
+    int c, fd, passes=1, pass, iovcnt;
+
+    while((c=getopt(argc, argv, "cn:"))!=-1) {
+        switch(c) {
+            case 'c':
+                classic=1;
+                break;
+            case 'n':
+                passes=atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c] [-n passes] trace\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind+1!=argc) {
+        fprintf(stderr, "usage: %s [-c] [-n passes] trace\n", argv[0]);
+        return 1;
+    }
+
+    fd=open(argv[optind], O_RDONLY);
+    if(fd<0 || fstat(fd, &st)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if(st.st_size<8) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+    map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map==MAP_FAILED) {
+        perror("mmap()");
+        return 1;
+    }
+    close(fd);
+    if(memcmp(map, TELNET_TRACE_MAGIC, 8)) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+    madvise((void*)map, st.st_size, MADV_WILLNEED);
+    end=map+st.st_size;
+
+    conns.mask=255;
+    conns.used=0;
+    conns.slots=calloc(conns.mask+1, sizeof(*conns.slots));
+    memset(&t, 0, sizeof(t));
+    for(pass=0;pass<passes;pass++) {
+        iovcnt=0;
+        for(p=map+8;p+sizeof(rec)<=end;p+=sizeof(rec)+rec.len) {
+            /* records are not aligned in the file */
+            memcpy(&rec, p, sizeof(rec));
+            if(rec.len>(size_t)(end-p)-sizeof(rec)) {
+                if(!pass) fprintf(stderr, "trace is cut short, ignoring the last record\n");
+                break;
+            }
+            if(!pass) {
+                if(!records) first_ns=rec.time_ns;
+                last_ns=rec.time_ns;
+                records++;
+            }
+            /* a read cut short by another connection's records */
+            if(iovcnt && (rec.conn!=pending || (rec.flags&TelnetTraceStart))) {
+                replay_flush(&conns, pending, iov, iovcnt, &t);
+                iovcnt=0;
+            }
+            if(rec.flags&TelnetTraceStart) {
+                conn_get(&conns, rec.conn, 1);
+                continue;
+            }
+            pending=rec.conn;
+            iov[iovcnt].iov_base=(void*)(p+sizeof(rec));
+            iov[iovcnt].iov_len=rec.len;
+            iovcnt++;
+            if((rec.flags&TelnetTraceMore) && iovcnt<MAX_IOV) continue;
+            replay_flush(&conns, pending, iov, iovcnt, &t);
+            iovcnt=0;
+        }
+        if(iovcnt) replay_flush(&conns, pending, iov, iovcnt, &t);
+        conn_free_all(&conns);
+    }
+
+    printf("%lu records over %.3f s, %llu reads, %llu bytes, %llu events in %d pass%s\n",
+        records, (last_ns-first_ns)*1e-9, t.reads, t.bytes, t.events, passes, passes==1 ? "" : "es");
+    if(t.elapsed>0) {
+        printf("%.3f GB/s, %.2f ns/read, %.2f ns/event\n", t.bytes/t.elapsed/1e9,
+            t.reads ? t.elapsed*1e9/t.reads : 0.0, t.events ? t.elapsed*1e9/t.events : 0.0);
+    }
+    hist_print("time per read", &t.per_read);
+    hist_print("time per event", &t.per_event);
+    fprintf(stderr, "checksum %llu\n", checksum);
+    free(conns.slots);
+    munmap((void*)map, st.st_size);
+    return 0;
+}
@@ -1,19 +1,1249 @@
 /**************************** TEST & EXAMPLE CODE ****************************/
 
 #define JDM_TELNET_IMPLEMENTATION
-#define JDM_TELNET_DEBUG
+#define JDM_TELNET_STATS
+#define JDM_TELNET_STATS_OPTIONS
+#define JDM_TELNET_TRACE
 #include "jdm_telnet.h"
 
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
 /* USAGE:
  *  + TODO - explain how to use it
  * IDEAS:
  *  + combine telnet_end() and telnet_continue() ?
- * TODO:
- *   + handle control messages and responses in the struct (an NVT driver?)
- *   + add ways to automate the building of control messages
  */
 
-int main() {
+static int failures;
+static int render_flags; /* telnet_setflags() for the render_xxx() helpers */
+
+#define CHECK(x) do { \
+        if(!(x)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+            failures++; \
+        } \
+    } while(0)
+
+/* IAC scanning must agree with a plain byte loop at every length and
+ * alignment, including the tails that the vector loops leave over.
+ */
+static void test_scan(void) {
+    unsigned char buf[300];
+    size_t ofs, len, pos;
+
+    memset(buf, 'a', sizeof(buf));
+    for(ofs=0;ofs<8;ofs++) {
+        for(len=0;len<=200;len++) {
+            CHECK(telnet_scan_iac(buf+ofs, len)==len);
+            for(pos=0;pos<len;pos++) {
+                buf[ofs+pos]=IAC;
+                CHECK(telnet_scan_iac(buf+ofs, len)==pos);
+                buf[ofs+pos]='a';
+            }
+        }
+    }
+    /* an IAC just past the end must not be seen */
+    buf[100]=IAC;
+    CHECK(telnet_scan_iac(buf, 100)==100);
+    buf[100]='a';
+
+    /* the same for either of two bytes */
+    for(len=0;len<=100;len++) {
+        for(pos=0;pos<len;pos++) {
+            buf[pos]='\r';
+            CHECK(telnet_scan2(buf, len, IAC, '\r')==pos);
+            CHECK(telnet_scan2(buf, len, IAC, IAC)==len);
+            buf[pos]=IAC;
+            CHECK(telnet_scan2(buf, len, IAC, '\r')==pos);
+            buf[pos]='a';
+        }
+    }
+}
+
+/* append a printable form of a control message to out */
+static size_t render_control(char *out, unsigned char cmd, unsigned char opt, size_t exlen, const unsigned char *ex) {
+    size_t n, i;
+
+    n=sprintf(out, "<%u %u", cmd, opt);
+    for(i=0;ex && i<exlen;i++) {
+        n+=sprintf(out+n, " %02X", ex[i]);
+    }
+    out[n++]='>';
+    return n;
+}
+
+/* decode in[] fed in pieces of frag bytes with telnet_gettext() and
+ * telnet_getcontrol(), rendering everything into out.
+ * inplace decodes a writable copy with telnet_begin_inplace().
+ */
+static size_t render_classic(size_t in_len, const char *in, size_t frag, char *out, int inplace) {
+    struct telnet_info *ts=telnet_create(0);
+    static char copy[1024];
+    size_t pos, n=0;
+
+    assert(in_len <= sizeof(copy));
+    memcpy(copy, in, in_len);
+    telnet_setflags(ts, render_flags);
+    for(pos=0;pos<in_len;pos+=frag) {
+        if(inplace) {
+            telnet_begin_inplace(ts, pos+frag<in_len ? frag : in_len-pos, copy+pos);
+        } else {
+            telnet_begin(ts, pos+frag<in_len ? frag : in_len-pos, in+pos);
+        }
+        while(telnet_continue(ts)) {
+            const char *text;
+            size_t text_len, exlen;
+            const unsigned char *ex;
+            unsigned char cmd, opt;
+
+            if(telnet_gettext(ts, &text_len, &text)) {
+                memcpy(out+n, text, text_len);
+                n+=text_len;
+            }
+            if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+                n+=render_control(out+n, cmd, opt, exlen, ex);
+            }
+        }
+        telnet_end(ts);
+    }
+    telnet_free(ts);
+    return n;
+}
+
+/* same as render_classic() using telnet_parse_batch() */
+static size_t render_batch(size_t in_len, const char *in, size_t frag, char *out) {
+    struct telnet_info *ts=telnet_create(0);
+    struct telnet_event ev[4];
+    size_t pos, n=0;
+    int i, count;
+
+    telnet_setflags(ts, render_flags);
+    for(pos=0;pos<in_len;pos+=frag) {
+        telnet_begin(ts, pos+frag<in_len ? frag : in_len-pos, in+pos);
+        while(telnet_continue(ts)) {
+            count=telnet_parse_batch(ts, ev, 4);
+            for(i=0;i<count;i++) {
+                if(ev[i].type==TelnetEventText) {
+                    memcpy(out+n, ev[i].extra ? (const char*)ev[i].extra : in+pos+ev[i].offset, ev[i].len);
+                    n+=ev[i].len;
+                } else {
+                    CHECK(ev[i].type!=TelnetEventNegotiate || (ev[i].command>=WILL && ev[i].command<=DONT));
+                    n+=render_control(out+n, ev[i].command, ev[i].option, ev[i].len, ev[i].extra);
+                }
+            }
+        }
+        telnet_end(ts);
+    }
+    telnet_free(ts);
+    return n;
+}
+
+static const char mixed_stream[]=
+    "hello \377\377world\r\n"
+    "\377\373\1\377\364\377\361"            /* IAC WILL ECHO, IAC IP, IAC NOP */
+    "\377\372\37\0\120\0\30\377\360"      /* IAC SB NAWS 80x24 IAC SE */
+    "more text\377\375\42"                    /* IAC DO LINEMODE */
+    "\377\372\30\0xterm\377\377\377\360"   /* IAC SB TTYPE IS xterm IAC IAC IAC SE */
+    "\377\360tail";                           /* stray IAC SE */
+
+/* the batch decoder must produce the same stream as the classic loop,
+ * however the input is fragmented.
+ */
+static void test_batch(void) {
+    static char want[1024], got[1024];
+    size_t want_len, got_len, frag;
+
+    for(frag=1;frag<=sizeof(mixed_stream);frag++) {
+        want_len=render_classic(sizeof(mixed_stream)-1, mixed_stream, frag, want, 0);
+        got_len=render_batch(sizeof(mixed_stream)-1, mixed_stream, frag, got);
+        CHECK(want_len==got_len && !memcmp(want, got, want_len));
+    }
+}
+
+/* the stream cut into iovecs at a and b, with an empty one in between,
+ * through telnet_beginv() and either decoder. spans must point into the
+ * iovec they came from.
+ */
+static size_t render_vector(size_t in_len, const char *in, size_t a, size_t b, int batch, char *out) {
+    struct telnet_info *ts=telnet_create(0);
+    struct telnet_event ev[4];
+    struct iovec iov[4];
+    size_t n=0, text_len, exlen;
+    const char *text;
+    const unsigned char *ex;
+    unsigned char cmd, opt;
+    int i, count;
+
+    iov[0].iov_base=(void*)in;
+    iov[0].iov_len=a;
+    iov[1].iov_base=(void*)(in+a);
+    iov[1].iov_len=0;
+    iov[2].iov_base=(void*)(in+a);
+    iov[2].iov_len=b-a;
+    iov[3].iov_base=(void*)(in+b);
+    iov[3].iov_len=in_len-b;
+    telnet_setflags(ts, render_flags);
+    telnet_beginv(ts, iov, 4);
+    while(telnet_continue(ts)) {
+        if(batch) {
+            count=telnet_parse_batch(ts, ev, 4);
+            for(i=0;i<count;i++) {
+                if(ev[i].type==TelnetEventText) {
+                    CHECK(ev[i].extra || ev[i].offset+ev[i].len<=iov[ev[i].seg].iov_len);
+                    memcpy(out+n, ev[i].extra ? (const char*)ev[i].extra : (const char*)iov[ev[i].seg].iov_base+ev[i].offset, ev[i].len);
+                    n+=ev[i].len;
+                } else {
+                    n+=render_control(out+n, ev[i].command, ev[i].option, ev[i].len, ev[i].extra);
+                }
+            }
+            continue;
+        }
+        if(telnet_gettext(ts, &text_len, &text)) {
+            CHECK(!text_len || text<(const char*)iov[telnet_segment(ts)].iov_base+iov[telnet_segment(ts)].iov_len);
+            memcpy(out+n, text, text_len);
+            n+=text_len;
+        }
+        if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+            n+=render_control(out+n, cmd, opt, exlen, ex);
+        }
+    }
+    CHECK(telnet_end(ts));
+    telnet_free(ts);
+    return n;
+}
+
+/* a wrapped ring or readv() buffers decode the same as one buffer */
+static void test_beginv(void) {
+    static char want[1024], got[1024];
+    size_t len=sizeof(mixed_stream)-1, want_len, got_len, a, b;
+    int batch;
+
+    for(render_flags=0;render_flags<=TelnetFlagNewline;render_flags+=TelnetFlagNewline) {
+        want_len=render_classic(len, mixed_stream, len, want, 0);
+        for(a=0;a<=len;a++) {
+            for(b=a;b<=len;b++) {
+                for(batch=0;batch<2;batch++) {
+                    got_len=render_vector(len, mixed_stream, a, b, batch, got);
+                    CHECK(got_len==want_len && !memcmp(want, got, want_len));
+                }
+            }
+        }
+    }
+    render_flags=0;
+}
+
+/* IAC IAC collapses in place into one run of text */
+static void test_inplace(void) {
+    static char want[1024], got[1024];
+    char buf[]="ab\377\377cd\377\377\377\377ef\377\361gh\377\377";
+    struct telnet_info *ts=telnet_create(0);
+    size_t want_len, got_len, frag, len;
+    const char *text;
+    unsigned char cmd, opt;
+
+    telnet_begin_inplace(ts, sizeof(buf)-1, buf);
+    CHECK(telnet_gettext(ts, &len, &text)==1);
+    CHECK(len==9 && text==buf && !memcmp(text, "ab\377cd\377\377ef", 9));
+    CHECK(telnet_getcontrol(ts, &cmd, &opt, NULL, NULL)==1 && cmd==NOP);
+    CHECK(telnet_gettext(ts, &len, &text)==1);
+    CHECK(len==3 && !memcmp(text, "gh\377", 3));
+    CHECK(!telnet_continue(ts));
+    telnet_end(ts);
+    telnet_free(ts);
+
+    for(frag=1;frag<=sizeof(mixed_stream);frag++) {
+        want_len=render_classic(sizeof(mixed_stream)-1, mixed_stream, frag, want, 0);
+        got_len=render_classic(sizeof(mixed_stream)-1, mixed_stream, frag, got, 1);
+        CHECK(want_len==got_len && !memcmp(want, got, want_len));
+    }
+}
+
+/* NVT newlines are normalized the same way by every decoder, wherever the
+ * buffers are split.
+ */
+static void test_newline(void) {
+    static const char in[]=
+        "a\r\nb\r\0c\nd\re"                /* CR LF, CR NUL, bare LF, bare CR */
+        "\r\r\n\377\377\r\n"                 /* CR CR LF, escaped IAC then CR LF */
+        "x\r\377\361y\r\0\377\361z";          /* CR then IAC NOP, CR NUL then IAC NOP */
+    static const char want[]="a\nb\rc\nd\re\r\n\377\nx\r<241 0>y\r<241 0>z";
+    static char got[1024];
+    size_t got_len, frag;
+
+    render_flags=TelnetFlagNewline;
+    for(frag=1;frag<=sizeof(in);frag++) {
+        got_len=render_classic(sizeof(in)-1, in, frag, got, 0);
+        CHECK(got_len==sizeof(want)-1 && !memcmp(got, want, got_len));
+        got_len=render_classic(sizeof(in)-1, in, frag, got, 1);
+        CHECK(got_len==sizeof(want)-1 && !memcmp(got, want, got_len));
+        got_len=render_batch(sizeof(in)-1, in, frag, got);
+        CHECK(got_len==sizeof(want)-1 && !memcmp(got, want, got_len));
+    }
+    render_flags=0;
+}
+
+/* join the slices of every complete line in lb into out, one '|' after each */
+static size_t linebuf_collect(struct telnet_linebuf *lb, char *out) {
+    struct telnet_line lines[2];
+    size_t n=0;
+    int i, count;
+
+    while((count=telnet_linebuf_get(lb, lines, 2))>0) {
+        for(i=0;i<count;i++) {
+            memcpy(out+n, lines[i].text[0], lines[i].len[0]);
+            n+=lines[i].len[0];
+            if(lines[i].len[1]) memcpy(out+n, lines[i].text[1], lines[i].len[1]);
+            n+=lines[i].len[1];
+            out[n++]='|';
+        }
+    }
+    return n;
+}
+
+/* cooked lines with EC/EL editing, through both decoders and any split */
+static void test_linebuf(void) {
+    static const char in[]=
+        "hel\377\367lo\r\n"            /* IAC EC */
+        "wor\377\370world\n"            /* IAC EL */
+        "x\r\0y\177z\b\b\bq\377\361\r\n";  /* CR NUL, DEL, BS past the start, IAC NOP */
+    static const char want[]="helo|world|x|q|";
+    struct telnet_linebuf *lb;
+    struct telnet_info *ts;
+    struct telnet_line line;
+    struct telnet_event ev[4];
+    char got[256];
+    size_t got_len, frag, pos, len;
+    const char *text;
+    unsigned char cmd, opt;
+    int batch, nops;
+
+    for(batch=0;batch<2;batch++) {
+        for(frag=1;frag<=sizeof(in);frag++) {
+            ts=telnet_create(0);
+            lb=telnet_linebuf_create(64);
+            telnet_setlinebuf(ts, lb);
+            CHECK(telnet_getflags(ts)&TelnetFlagNewline);
+            got_len=0;
+            nops=0;
+            for(pos=0;pos<sizeof(in)-1;pos+=frag) {
+                telnet_begin(ts, pos+frag<sizeof(in)-1 ? frag : sizeof(in)-1-pos, in+pos);
+                while(telnet_continue(ts)) {
+                    if(batch) {
+                        int i, count=telnet_parse_batch(ts, ev, 4);
+                        for(i=0;i<count;i++) {
+                            CHECK(ev[i].type!=TelnetEventText);
+                            nops+=ev[i].command==NOP;
+                        }
+                    } else {
+                        if(telnet_gettext(ts, &len, &text)) CHECK(len==0);
+                        if(telnet_getcontrol(ts, &cmd, &opt, NULL, NULL)) {
+                            CHECK(cmd==NOP);
+                            nops++;
+                        }
+                    }
+                }
+                telnet_end(ts);
+                got_len+=linebuf_collect(lb, got+got_len);
+            }
+            CHECK(nops==1);
+            CHECK(got_len==sizeof(want)-1 && !memcmp(got, want, got_len));
+            CHECK(telnet_linebuf_dropped(lb)==0);
+            telnet_linebuf_free(lb);
+            telnet_free(ts);
+        }
+    }
+
+    /* a line across the end of the ring comes back in two slices */
+    ts=telnet_create(0);
+    lb=telnet_linebuf_create(16);
+    telnet_setlinebuf(ts, lb);
+    telnet_begin(ts, 11, "0123456789\n");
+    while(telnet_continue(ts)) telnet_gettext(ts, &len, &text);
+    telnet_end(ts);
+    CHECK(telnet_linebuf_get(lb, &line, 1)==1 && line.len[0]==10 && line.len[1]==0);
+    telnet_begin(ts, 11, "abcdefghij\n");
+    while(telnet_continue(ts)) telnet_gettext(ts, &len, &text);
+    telnet_end(ts);
+    CHECK(telnet_linebuf_get(lb, &line, 1)==1);
+    CHECK(line.len[0]==5 && !memcmp(line.text[0], "abcde", 5));
+    CHECK(line.len[1]==5 && !memcmp(line.text[1], "fghij", 5));
+    CHECK(telnet_linebuf_get(lb, &line, 1)==0);
+
+    /* a line longer than the ring is cut short */
+    telnet_begin(ts, 21, "abcdefghijklmnopqrst\n");
+    while(telnet_continue(ts)) telnet_gettext(ts, &len, &text);
+    telnet_end(ts);
+    CHECK(telnet_linebuf_get(lb, &line, 1)==1 && line.len[0]+line.len[1]==15);
+    CHECK(telnet_linebuf_dropped(lb)==5);
+    telnet_linebuf_free(lb);
+    telnet_free(ts);
+}
+
+#ifdef JDM_TELNET_MCCP
+/* decode a server stream that may turn on MCCP2 part way through, fed in
+ * pieces of frag bytes. text and controls are rendered into out.
+ */
+static size_t mccp_client(size_t in_len, const char *in, size_t frag, char *out) {
+    struct telnet_info *ts=telnet_create(0);
+    struct telnet_mccp *mc=NULL;
+    static char plain[4096];
+    size_t pos, n=0, piece, plain_len, used;
+    const char *p;
+    int e=0;
+
+    for(pos=0;pos<in_len;pos+=frag) {
+        piece=pos+frag<in_len ? frag : in_len-pos;
+        p=in+pos;
+        while(piece) {
+            if(mc && e==0) {
+                /* compressed: inflate first, then parse what came out */
+                e=telnet_mccp_decompress(mc, (unsigned char*)plain, sizeof(plain), piece, p, &used, &plain_len);
+                CHECK(e>=0);
+                p+=used;
+                piece-=used;
+                telnet_begin(ts, plain_len, plain);
+            } else {
+                telnet_begin(ts, piece, p);
+                piece=0;
+            }
+            while(telnet_continue(ts)) {
+                const char *text;
+                size_t text_len, exlen;
+                const unsigned char *ex;
+                unsigned char cmd, opt;
+
+                if(telnet_gettext(ts, &text_len, &text)) {
+                    memcpy(out+n, text, text_len);
+                    n+=text_len;
+                }
+                if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+                    n+=render_control(out+n, cmd, opt, exlen, ex);
+                    if(cmd==SB && opt==TELOPT_COMPRESS2) {
+                        /* the rest of this buffer is compressed */
+                        CHECK(!mc);
+                        mc=telnet_mccp_inflate_create();
+                        piece+=telnet_rest(ts, &p);
+                    }
+                }
+            }
+            telnet_end(ts);
+        }
+    }
+    CHECK(e==1);
+    telnet_mccp_free(mc);
+    telnet_free(ts);
+    return n;
+}
+
+/* MCCP2 round trip: plain, compressed with sync flushes into a small output
+ * buffer, finished, then plain again.
+ */
+static void test_mccp(void) {
+    static const char want[]="login: <250 86 56>hello \377 world\r\n<249 0>and more\r\nplain";
+    static char stream[4096], got[4096];
+    struct telnet_mccp *mc=telnet_mccp_create(9, 10, 2);
+    unsigned char chunk[7];
+    size_t n=0, pos, consumed, out, frag, got_len;
+    static const char *parts[]={ "hello \377\377 world\r\n\377\371", "and more\r\n" };
+    int i, flush;
+
+    CHECK(mc != NULL);
+    memcpy(stream, "login: ", 7);
+    n=7;
+    n+=telnet_mccp_start((unsigned char*)stream+n);
+    for(i=0;i<2;i++) {
+        flush=i ? TelnetMccpFinish : TelnetMccpSync;
+        pos=0;
+        do {
+            out=telnet_mccp_compress(mc, chunk, sizeof(chunk), strlen(parts[i])-pos, parts[i]+pos, &consumed, flush);
+            pos+=consumed;
+            memcpy(stream+n, chunk, out);
+            n+=out;
+        } while(out==sizeof(chunk) || pos<strlen(parts[i]));
+    }
+    CHECK(telnet_mccp_compress(mc, chunk, sizeof(chunk), 0, "", &consumed, TelnetMccpFinish)==0);
+    telnet_mccp_free(mc);
+    memcpy(stream+n, "plain", 5);
+    n+=5;
+
+    for(frag=1;frag<=n;frag++) {
+        got_len=mccp_client(n, stream, frag, got);
+        CHECK(got_len==sizeof(want)-1 && !memcmp(got, want, got_len));
+    }
+
+    /* corrupt data is reported */
+    mc=telnet_mccp_inflate_create();
+    CHECK(telnet_mccp_decompress(mc, (unsigned char*)got, sizeof(got), 4, "\377\377\377\377", &consumed, &out)==-1);
+    telnet_mccp_free(mc);
+}
+#endif
+
+/* escaping through iovecs and through a copy must both double every IAC,
+ * however small the output is.
+ */
+static void test_escape(void) {
+    static const char text[]="\377a\377\377bc\377d\377";
+    static const char want[]="\377\377a\377\377\377\377bc\377\377d\377\377";
+    char got[64];
+    unsigned char frame[16];
+    struct iovec iov[8];
+    size_t pos, n, i, consumed;
+    int iov_max, count;
+
+    for(iov_max=2;iov_max<=8;iov_max++) {
+        n=0;
+        for(pos=0;pos<sizeof(text)-1;pos+=consumed) {
+            count=telnet_escape_iov(iov, iov_max, sizeof(text)-1-pos, text+pos, &consumed);
+            CHECK(count>0 && count<=iov_max);
+            for(i=0;i<(size_t)count;i++) {
+                CHECK((const char*)iov[i].iov_base>=text && (const char*)iov[i].iov_base<text+sizeof(text));
+                memcpy(got+n, iov[i].iov_base, iov[i].iov_len);
+                n+=iov[i].iov_len;
+            }
+        }
+        CHECK(n==sizeof(want)-1 && !memcmp(got, want, n));
+    }
+
+    for(i=2;i<=sizeof(want);i++) {
+        size_t len;
+        n=0;
+        for(pos=0;pos<sizeof(text)-1;pos+=consumed) {
+            len=telnet_escape(got+n, i, sizeof(text)-1-pos, text+pos, &consumed);
+            CHECK(len<=i && consumed>0);
+            n+=len;
+        }
+        CHECK(n==sizeof(want)-1 && !memcmp(got, want, n));
+    }
+
+    CHECK(telnet_encode_command(frame, GA)==2 && frame[0]==IAC && frame[1]==GA);
+    CHECK(telnet_encode_option(frame, WILL, TELOPT_ECHO)==3 && !memcmp(frame, "\377\373\1", 3));
+    CHECK(telnet_encode_subneg(frame, sizeof(frame), TELOPT_TTYPE, 3, (const unsigned char*)"\1a\377")==9);
+    CHECK(!memcmp(frame, "\377\372\30\1a\377\377\377\360", 9));
+    CHECK(telnet_encode_subneg(frame, 8, TELOPT_TTYPE, 3, (const unsigned char*)"\1a\377")==0);
+}
+
+/* read everything a pipe holds right now */
+static size_t drain(int fd, char *out, size_t max) {
+    ssize_t r;
+    size_t n=0;
+
+    while(n<max && (r=read(fd, out+n, max-n))>0) n+=r;
+    return n;
+}
+
+/* output queue: coalescing, escaping, partial writes against a full pipe,
+ * watermarks and discard.
+ */
+static void test_outq(void) {
+    static char big[100000], got[200000];
+    struct telnet_outq *q=telnet_outq_create(64, 100, 1000);
+    struct iovec iov[4];
+    size_t i, n, total;
+    ssize_t w;
+    int fds[2];
+
+    CHECK(q != NULL);
+    CHECK(pipe(fds)==0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    /* small appends share a segment, IAC is doubled */
+    CHECK(telnet_outq_text(q, 4, "ab\377c"));
+    CHECK(telnet_outq_raw(q, 2, "\377\371"));
+    CHECK(telnet_outq_pending(q)==7);
+    CHECK(telnet_outq_peek(q, iov, 4)==1 && iov[0].iov_len==7);
+    CHECK(telnet_outq_flush(q, fds[1])==7);
+    CHECK(telnet_outq_pending(q)==0 && telnet_outq_peek(q, iov, 4)==0);
+    CHECK(drain(fds[0], got, sizeof(got))==7 && !memcmp(got, "ab\377\377c\377\371", 7));
+
+    /* an append that does not fit starts a new segment, a long one gets
+     * a segment of its own. partial consume keeps the rest.
+     */
+    CHECK(telnet_outq_text(q, 60, big));
+    CHECK(telnet_outq_text(q, 10, "0123456789"));
+    CHECK(telnet_outq_text(q, 200, big));
+    CHECK(telnet_outq_peek(q, iov, 4)==3 && iov[0].iov_len==60 && iov[1].iov_len==10 && iov[2].iov_len==200);
+    telnet_outq_consume(q, 65);
+    CHECK(telnet_outq_peek(q, iov, 4)==2 && iov[0].iov_len==5 && !memcmp(iov[0].iov_base, "56789", 5));
+
+    /* discard keeps the partly written segment only */
+    telnet_outq_discard(q);
+    CHECK(telnet_outq_pending(q)==5);
+    telnet_outq_consume(q, 5);
+    CHECK(telnet_outq_pending(q)==0);
+
+    /* fill the pipe: flush stops on EAGAIN with the rest still queued,
+     * throttled until the queue drains to the low watermark.
+     */
+    for(i=0;i<sizeof(big);i++) big[i]=(char)(i%251);
+    for(i=0;i<sizeof(big);i+=1000) CHECK(telnet_outq_text(q, 1000, big+i));
+    total=telnet_outq_pending(q);
+    CHECK(telnet_outq_throttled(q));
+    n=0;
+    while(telnet_outq_pending(q)) {
+        w=telnet_outq_flush(q, fds[1]);
+        CHECK(w>=0);
+        if(telnet_outq_pending(q)>1000) CHECK(telnet_outq_throttled(q));
+        n+=drain(fds[0], got+n, sizeof(got)-n);
+    }
+    CHECK(!telnet_outq_throttled(q));
+    CHECK(n==total);
+    for(i=0, n=0;i<sizeof(big);i++) {
+        if(got[n]!=big[i]) break;
+        n+=(unsigned char)big[i]==IAC ? 2 : 1;
+    }
+    CHECK(i==sizeof(big));
+
+    /* a closed reader is an error */
+    close(fds[0]);
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(telnet_outq_raw(q, 3, "abc"));
+    CHECK(telnet_outq_flush(q, fds[1])==-1 && errno==EPIPE);
+    CHECK(telnet_outq_pending(q)==3);
+    close(fds[1]);
+    telnet_outq_free(q);
+}
+
+/* everything queued, the way a completion based writer takes it */
+static size_t outq_take(struct telnet_outq *q, char *out) {
+    struct iovec iov[4];
+    size_t n=0;
+    int i, k;
+
+    while((k=telnet_outq_peek(q, iov, 4))>0) {
+        for(i=0;i<k;i++) {
+            memcpy(out+n, iov[i].iov_base, iov[i].iov_len);
+            n+=iov[i].iov_len;
+            telnet_outq_consume(q, iov[i].iov_len);
+        }
+    }
+    return n;
+}
+
+/* a frame is escaped once and queued by reference, in between other output */
+static void test_frame(void) {
+    static char got[256];
+    struct telnet_outq *q[3];
+    struct telnet_frame *f=telnet_frame_create(7, "chat\377!\n");
+    int i;
+
+    CHECK(f != NULL && telnet_frame_len(f)==8);
+    for(i=0;i<3;i++) {
+        q[i]=telnet_outq_create(16, 0, 0);
+        CHECK(telnet_outq_text(q[i], 2, "> "));
+        CHECK(telnet_outq_frame(q[i], f));
+        CHECK(telnet_outq_raw(q[i], 2, "\377\371"));
+    }
+    telnet_frame_unref(f); /* the queues keep it alive */
+    CHECK(outq_take(q[0], got)==12 && !memcmp(got, "> chat\377\377!\n\377\371", 12));
+    CHECK(outq_take(q[1], got)==12 && !memcmp(got, "> chat\377\377!\n\377\371", 12));
+    /* discard drops the reference too, ASan checks the last one frees it */
+    telnet_outq_discard(q[2]);
+    CHECK(telnet_outq_pending(q[2])==0);
+    for(i=0;i<3;i++) telnet_outq_free(q[i]);
+}
+
+#ifdef JDM_TELNET_MCCP
+/* output queue with MCCP2: queued text comes out compressed and sync
+ * flushed, commands queued before compression are left alone.
+ */
+static void test_outq_mccp(void) {
+    static char big[50000], got[200000], plain[200000];
+    struct telnet_outq *q=telnet_outq_create(256, 0, 0);
+    struct telnet_mccp *mc=telnet_mccp_create(6, 0, 0);
+    struct telnet_mccp *in=telnet_mccp_inflate_create();
+    unsigned char start[5];
+    size_t i, n, used, plain_len, out_len;
+    int fds[2], round;
+
+    CHECK(pipe(fds)==0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    for(i=0;i<sizeof(big);i++) big[i]=(char)('a'+(i*7)%26);
+    CHECK(telnet_outq_text(q, 7, "login: "));
+    CHECK(telnet_outq_raw(q, telnet_mccp_start(start), start));
+    CHECK(telnet_outq_flush(q, fds[1])==12);
+    CHECK(drain(fds[0], got, sizeof(got))==12 && !memcmp(got, "login: \377\372\126\377\360", 12));
+    telnet_outq_setmccp(q, mc);
+    for(round=0;round<2;round++) {
+        CHECK(telnet_outq_text(q, 6, "hello\377"));
+        CHECK(telnet_outq_text(q, sizeof(big), big));
+        if(round==0) {
+            /* start compressing, then drop what is still queued */
+            struct iovec iov[1];
+
+            CHECK(telnet_outq_peek(q, iov, 1)==1);
+            telnet_outq_discard(q);
+        }
+        n=0;
+        while(telnet_outq_pending(q)) {
+            CHECK(telnet_outq_flush(q, fds[1])>=0);
+            n+=drain(fds[0], got+n, sizeof(got)-n);
+        }
+        i=0;
+        /* a sync flush ends every burst, so all of it inflates now */
+        out_len=0;
+        while(i<n) {
+            CHECK(telnet_mccp_decompress(in, (unsigned char*)plain+out_len, sizeof(plain)-out_len, n-i, got+i, &used, &plain_len)==0);
+            i+=used;
+            out_len+=plain_len;
+        }
+        if(round==0) {
+            /* what zlib took before the discard still arrives whole */
+            CHECK(out_len>=7 && out_len<=7+sizeof(big) && !memcmp(plain, "hello\377\377", 7));
+            CHECK(!memcmp(plain+7, big, out_len-7));
+        } else {
+            CHECK(out_len==7+sizeof(big) && !memcmp(plain, "hello\377\377", 7) && !memcmp(plain+7, big, sizeof(big)));
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    telnet_outq_free(q);
+    telnet_mccp_free(mc);
+    telnet_mccp_free(in);
+}
+
+/* inflate a whole MCCP stream, checking it ends with a good adler32 */
+static size_t inflate_all(size_t len, const char *in, char *out, size_t *used) {
+    struct telnet_mccp *mc=telnet_mccp_inflate_create();
+    size_t pos=0, n=0, consumed, produced;
+    int e=0;
+
+    while(pos<len && e==0) {
+        e=telnet_mccp_decompress(mc, (unsigned char*)out+n, 1<<20, len-pos, in+pos, &consumed, &produced);
+        pos+=consumed;
+        n+=produced;
+    }
+    CHECK(e==1);
+    telnet_mccp_free(mc);
+    *used=pos;
+    return n;
+}
+
+/* frames in both MCCP modes. shared mode has no zlib state per queue, the
+ * stream is spliced from stored blocks and compressed frames.
+ */
+static void test_frame_mccp(void) {
+    static char big[70000], got[1<<20], plain[1<<20], want[1<<20];
+    struct telnet_frame *small, *large, *dropped;
+    struct telnet_mccp *mc;
+    struct telnet_outq *q;
+    size_t i, n, w, used;
+    int mode;
+
+    for(i=0;i<sizeof(big);i++) big[i]=(char)(i%5 ? 'a'+i%23 : 0xff);
+    small=telnet_frame_create(10, "tell \377 me");
+    large=telnet_frame_create(sizeof(big), big);
+    dropped=telnet_frame_create(4, "gone");
+    CHECK(telnet_frame_compress(small, 6));
+    CHECK(telnet_frame_compress(dropped, 6));
+    /* large stays uncompressed: stored blocks pointing into the frame */
+    w=telnet_escape(want, sizeof(want), 4, "hi \377", &used);
+    memcpy(want+w, "tell \377\377 me", 11);
+    w+=11;
+    w+=telnet_escape(want+w, sizeof(want)-w, sizeof(big), big, &used);
+    memcpy(want+w, "\377\371", 2);
+    w+=2;
+
+    for(mode=0;mode<2;mode++) {
+        q=telnet_outq_create(0, 0, 0);
+        mc=mode ? telnet_mccp_create(6, 0, 0) : NULL;
+        if(mode) {
+            telnet_outq_setmccp(q, mc);
+        } else {
+            telnet_outq_setmccp_shared(q);
+        }
+        CHECK(telnet_outq_text(q, 4, "hi \377"));
+        CHECK(telnet_outq_frame(q, small));
+        CHECK(telnet_outq_frame(q, large));
+        CHECK(telnet_outq_raw(q, 2, "\377\371"));
+        n=outq_take(q, got);
+        /* AO: queued and never sent, it is not part of the checksum */
+        CHECK(telnet_outq_frame(q, dropped));
+        telnet_outq_discard(q);
+        CHECK(telnet_outq_mccp_end(q));
+        CHECK(telnet_outq_text(q, 5, "plain"));
+        n+=outq_take(q, got+n);
+        CHECK(inflate_all(n, got, plain, &used)==w && !memcmp(plain, want, w));
+        CHECK(n-used==5 && !memcmp(got+used, "plain", 5));
+        telnet_outq_free(q);
+        telnet_mccp_free(mc);
+    }
+    telnet_frame_unref(small);
+    telnet_frame_unref(large);
+    telnet_frame_unref(dropped);
+}
+
+/* discard after a partial write in shared mode. the stored header of an
+ * uncompressed frame is in the segment before its data, the two are kept
+ * or dropped together, whether the header was cut or sent whole.
+ */
+static void test_frame_discard(void) {
+    static char text[100], got[1024], plain[1024];
+    static const size_t cut[2]={ 1, 15 }; /* zlib header, "hi " block, frame header */
+    struct telnet_frame *f;
+    struct telnet_outq *q;
+    struct iovec iov[4];
+    size_t i, n, used;
+
+    memset(text, 'x', sizeof(text));
+    f=telnet_frame_create(sizeof(text), text);
+    for(i=0;i<2;i++) {
+        q=telnet_outq_create(0, 0, 0);
+        telnet_outq_setmccp_shared(q);
+        CHECK(telnet_outq_text(q, 3, "hi "));
+        CHECK(telnet_outq_frame(q, f));
+        CHECK(telnet_outq_peek(q, iov, 4)==2 && iov[0].iov_len==15);
+        memcpy(got, iov[0].iov_base, cut[i]);
+        telnet_outq_consume(q, cut[i]);
+        telnet_outq_discard(q);
+        CHECK(telnet_outq_mccp_end(q));
+        n=cut[i]+outq_take(q, got+cut[i]);
+        CHECK(inflate_all(n, got, plain, &used)==3+sizeof(text) && used==n);
+        CHECK(!memcmp(plain, "hi ", 3) && !memcmp(plain+3, text, sizeof(text)));
+        telnet_outq_free(q);
+    }
+    telnet_frame_unref(f);
+}
+#endif
+
+/* hand a negotiation to the other end and bounce replies until quiet.
+ * returns the number of messages exchanged.
+ */
+static int q_deliver(struct telnet_info *to, struct telnet_info *from, size_t len, const unsigned char *msg) {
+    unsigned char reply[3];
+    int count=0;
+
+    while(len==3) {
+        struct telnet_info *tmp;
+        CHECK(msg[0]==IAC);
+        len=telnet_q_receive(to, msg[1], msg[2], reply);
+        msg=reply;
+        tmp=to;
+        to=from;
+        from=tmp;
+        count++;
+        CHECK(count<10);
+        if(count>=10) break;
+    }
+    CHECK(len==0);
+    return count;
+}
+
+static void test_qmethod(void) {
+    struct telnet_info *server=telnet_create(0), *client=telnet_create(0);
+    unsigned char out[3];
+    size_t len;
+
+    telnet_q_allow(client, TELOPT_ECHO, 0, 1);
+    telnet_q_allow(client, TELOPT_TTYPE, 1, 0);
+
+    /* WILL ECHO, DO ECHO */
+    len=telnet_q_request_us(server, TELOPT_ECHO, 1, out);
+    CHECK(len==3 && out[1]==WILL && out[2]==TELOPT_ECHO);
+    CHECK(!telnet_q_enabled_us(server, TELOPT_ECHO));
+    CHECK(q_deliver(client, server, len, out)==2);
+    CHECK(telnet_q_enabled_us(server, TELOPT_ECHO));
+    CHECK(telnet_q_enabled_him(client, TELOPT_ECHO));
+    /* asking again sends nothing */
+    CHECK(telnet_q_request_us(server, TELOPT_ECHO, 1, out)==0);
+
+    /* DO NAWS, refused with WONT NAWS */
+    len=telnet_q_request_him(server, TELOPT_NAWS, 1, out);
+    CHECK(len==3 && out[1]==DO);
+    CHECK(q_deliver(client, server, len, out)==2);
+    CHECK(!telnet_q_enabled_him(server, TELOPT_NAWS));
+    CHECK(!telnet_q_enabled_us(client, TELOPT_NAWS));
+
+    /* an unsolicited WONT for a disabled option is not answered */
+    CHECK(telnet_q_receive(server, WONT, TELOPT_NAWS, out)==0);
+
+    /* change of mind before the answer arrives: DO, then queued DONT */
+    len=telnet_q_request_him(server, TELOPT_TTYPE, 1, out);
+    CHECK(len==3);
+    CHECK(telnet_q_request_him(server, TELOPT_TTYPE, 0, out+0)==0);
+    len=telnet_q_request_him(server, TELOPT_TTYPE, 1, out); /* cancels the queued DONT */
+    CHECK(len==0);
+    CHECK(telnet_q_request_him(server, TELOPT_TTYPE, 0, out)==0);
+    out[0]=IAC;
+    out[1]=DO;
+    out[2]=TELOPT_TTYPE;
+    /* WILL comes back, DONT goes out, WONT comes back */
+    CHECK(q_deliver(client, server, 3, out)==4);
+    CHECK(!telnet_q_enabled_him(server, TELOPT_TTYPE));
+    CHECK(!telnet_q_enabled_us(client, TELOPT_TTYPE));
+
+    /* the peer turning off an enabled option is acknowledged once */
+    len=telnet_q_request_him(client, TELOPT_ECHO, 0, out);
+    CHECK(len==3 && out[1]==DONT);
+    CHECK(q_deliver(server, client, len, out)==2);
+    CHECK(!telnet_q_enabled_us(server, TELOPT_ECHO));
+    CHECK(!telnet_q_enabled_him(client, TELOPT_ECHO));
+
+    telnet_free(server);
+    telnet_free(client);
+}
+
+/* states from telnet_init() and from a pool work like telnet_create() ones */
+static void test_pool(void) {
+    union { void *p; double d; long l; char mem[4096]; } embed; /* room for the option counters */
+    struct telnet_info *ts[10], *again;
+    struct telnet_pool *pool;
+    const char *text;
+    size_t len;
+    int i;
+
+    CHECK(telnet_sizeof(0)==telnet_sizeof(48));
+    CHECK(telnet_sizeof(100)<=sizeof(embed));
+    ts[0]=telnet_init(&embed, 100);
+    CHECK(ts[0]==(void*)&embed);
+    telnet_begin(ts[0], 5, "abc\377\361");
+    CHECK(telnet_gettext(ts[0], &len, &text) && len==3);
+    telnet_fini(ts[0]);
+
+    pool=telnet_pool_create(0, 4);
+    for(i=0;i<10;i++) {
+        ts[i]=telnet_pool_acquire(pool);
+        CHECK(ts[i] != NULL);
+        CHECK(((size_t)ts[i] & 63)==0);
+        CHECK(i==0 || ts[i]!=ts[i-1]);
+    }
+    telnet_pool_release(pool, ts[3]);
+    again=telnet_pool_acquire(pool);
+    CHECK(again==ts[3]);
+    telnet_begin(again, 3, "x\377\361");
+    CHECK(telnet_gettext(again, &len, &text) && len==1 && *text=='x');
+    CHECK(telnet_end(again)==0);
+    for(i=0;i<10;i++) {
+        telnet_pool_release(pool, ts[i]);
+    }
+    telnet_pool_free(pool);
+}
+
+/* SB frames inside one buffer come back without a copy, the rest are
+ * reassembled with escapes removed.
+ */
+static void test_subneg(void) {
+    static const char frame[]="ab\377\372\37\0\120\0\30\377\360cd";
+    static const char escaped[]="\377\372\30\0x\377\377y\377\360";
+    struct telnet_info *ts=telnet_create(0);
+    const unsigned char *ex;
+    const char *text;
+    size_t exlen, len, split;
+    unsigned char cmd, opt;
+
+    telnet_begin(ts, sizeof(frame)-1, frame);
+    CHECK(telnet_gettext(ts, &len, &text) && len==2);
+    CHECK(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex));
+    CHECK(cmd==SB && opt==TELOPT_NAWS && exlen==5);
+    CHECK(ex==(const unsigned char*)frame+4);
+    CHECK(telnet_gettext(ts, &len, &text) && len==2 && !memcmp(text, "cd", 2));
+    CHECK(telnet_end(ts));
+
+    for(split=3;split<sizeof(frame)-3;split++) {
+        telnet_begin(ts, split, frame);
+        while(telnet_continue(ts)) {
+            telnet_gettext(ts, &len, &text);
+            CHECK(!telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex));
+        }
+        telnet_end(ts);
+        telnet_begin(ts, sizeof(frame)-1-split, frame+split);
+        if(split>4) {
+            CHECK(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex));
+            CHECK(cmd==SB && opt==TELOPT_NAWS && exlen==5);
+            CHECK(!memcmp(ex, "\37\0\120\0\30", 5));
+            CHECK(ex<(const unsigned char*)frame || ex>=(const unsigned char*)frame+sizeof(frame));
+        }
+        while(telnet_continue(ts)) {
+            telnet_gettext(ts, &len, &text);
+            telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex);
+        }
+        telnet_end(ts);
+    }
+
+    telnet_begin(ts, sizeof(escaped)-1, escaped);
+    CHECK(telnet_gettext(ts, &len, &text) && len==0);
+    CHECK(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex));
+    CHECK(cmd==SB && opt==TELOPT_TTYPE && exlen==5 && !memcmp(ex, "\30\0x\377y", 5));
+    CHECK(telnet_end(ts));
+    telnet_free(ts);
+}
+
+/* subnegotiation decoders, on payloads that went through the parser */
+static void test_sbdecode(void) {
+    static const char login[]=
+        "\377\372\37\1\0\0\30\377\360"
+        "\377\372\30\0xterm-256color\377\360"
+        "\377\372\47\0\0USER\1guest\3A\2\1B\1\2\3x\0EMPTY\1\0UNSET\377\360"
+        "\377\372\42\3\3\2\3\4\202\377\377\13\0\0\377\360";
+    struct telnet_info *ts=telnet_create(0);
+    struct telnet_event ev[8];
+    struct telnet_naws naws;
+    struct telnet_sbiter it;
+    struct telnet_environ var;
+    struct telnet_slc slc;
+    const char *name;
+    size_t len;
+    char tmp[16];
+
+    telnet_begin(ts, sizeof(login)-1, login);
+    CHECK(telnet_parse_batch(ts, ev, 8)==4);
+    CHECK(telnet_end(ts));
+
+    CHECK(telnet_decode_naws(ev[0].len, ev[0].extra, &naws) && naws.width==256 && naws.height==24);
+    CHECK(!telnet_decode_naws(ev[1].len, ev[1].extra, &naws));
+    CHECK(telnet_decode_ttype(ev[1].len, ev[1].extra, &name, &len) && len==14 && !memcmp(name, "xterm-256color", 14));
+    CHECK(!telnet_decode_ttype(ev[0].len, ev[0].extra, &name, &len));
+
+    CHECK(telnet_environ_begin(&it, ev[2].len, ev[2].extra)==TELQUAL_IS);
+    CHECK(telnet_environ_next(&it, &var) && var.type==NEW_ENV_VAR && var.has_value && !var.escaped);
+    CHECK(var.name_len==4 && !memcmp(var.name, "USER", 4) && var.value_len==5 && !memcmp(var.value, "guest", 5));
+    /* escapes stay in place, unescaping is up to the caller */
+    CHECK(telnet_environ_next(&it, &var) && var.type==ENV_USERVAR && var.escaped);
+    CHECK(var.name_len==4 && var.value_len==3);
+    CHECK(telnet_environ_unescape(tmp, var.name_len, var.name)==3 && !memcmp(tmp, "A\1B", 3));
+    CHECK(telnet_environ_unescape(tmp, var.value_len, var.value)==2 && !memcmp(tmp, "\3x", 2));
+    CHECK(telnet_environ_next(&it, &var) && var.has_value && var.value_len==0);
+    CHECK(telnet_environ_next(&it, &var) && !var.has_value && var.name_len==5);
+    CHECK(!telnet_environ_next(&it, &var));
+    CHECK(telnet_environ_begin(&it, ev[0].len, ev[0].extra)==-1);
+
+    CHECK(telnet_slc_begin(&it, ev[3].len, ev[3].extra));
+    CHECK(telnet_slc_next(&it, &slc) && slc.function==SLC_IP && slc.flags==SLC_VARIABLE && slc.value==3);
+    CHECK(telnet_slc_next(&it, &slc) && slc.function==SLC_AO && slc.flags==(SLC_ACK|SLC_VARIABLE) && slc.value==IAC);
+    CHECK(telnet_slc_next(&it, &slc) && slc.function==SLC_EL && slc.flags==SLC_NOSUPPORT && slc.value==0);
+    CHECK(!telnet_slc_next(&it, &slc));
+    CHECK(!telnet_slc_begin(&it, ev[2].len, ev[2].extra));
+    telnet_free(ts);
+}
+
+/* feed a 1000 byte SB payload across two buffers and collect it.
+ * returns the number of pieces, the payload is put back together in out.
+ */
+static int sb_collect(struct telnet_info *ts, unsigned char *out, size_t *out_len) {
+    static char frame[1010];
+    const unsigned char *ex;
+    const char *text;
+    size_t exlen, len, i;
+    unsigned char cmd, opt;
+    int pieces=0, half;
+
+    frame[0]=(char)IAC;
+    frame[1]=(char)SB;
+    for(i=0;i<1000;i++) {
+        frame[2+i]=(char)(i%251);
+    }
+    frame[2+500]=(char)IAC; /* an escaped IAC in the middle */
+    frame[2+501]=(char)IAC;
+    frame[1002]=(char)IAC;
+    frame[1003]=(char)SE;
+    *out_len=0;
+    for(half=0;half<2;half++) {
+        telnet_begin(ts, 502, frame+half*502);
+        while(telnet_continue(ts)) {
+            telnet_gettext(ts, &len, &text);
+            if(telnet_getcontrol(ts, &cmd, &opt, &exlen, &ex)) {
+                CHECK(cmd==SB && opt==0);
+                CHECK(!!(telnet_sbchunk(ts)&TelnetSbBegin)==(pieces==0));
+                memcpy(out+*out_len, ex, exlen);
+                *out_len+=exlen;
+                pieces++;
+            }
+        }
+        telnet_end(ts);
+    }
+    CHECK(telnet_sbchunk(ts)&TelnetSbEnd);
+    return pieces;
+}
+
+static void test_sbsize(void) {
+    struct telnet_info *ts;
+    unsigned char want[999], got[1100];
+    size_t got_len, i;
+
+    for(i=0;i<1000;i++) {
+        if(i<500) want[i]=(unsigned char)(i%251);
+        else if(i>500) want[i-1]=(unsigned char)(i%251);
+    }
+    want[500]=IAC;
+
+    /* default truncates */
+    ts=telnet_create(16);
+    CHECK(sb_collect(ts, got, &got_len)==1);
+    CHECK(got_len==16 && !memcmp(got, want, 16));
+    telnet_free(ts);
+
+    /* streaming returns every byte in extra_max sized pieces */
+    ts=telnet_create(16);
+    telnet_setflags(ts, TelnetFlagSbStream);
+    CHECK(sb_collect(ts, got, &got_len)>=999/16);
+    CHECK(got_len==999 && !memcmp(got, want, 999));
+    telnet_free(ts);
+
+    /* growing returns one piece, and the heap buffer is gone after telnet_end() */
+    ts=telnet_create(16);
+    telnet_setflags(ts, TelnetFlagSbGrow);
+    CHECK(sb_collect(ts, got, &got_len)==1);
+    CHECK(got_len==999 && !memcmp(got, want, 999));
+    CHECK(ts->extra==ts->extra_buf && ts->extra_max==16);
+    telnet_free(ts);
+
+    /* growing stops at the limit, then streams */
+    ts=telnet_create(16);
+    telnet_setflags(ts, TelnetFlagSbGrow|TelnetFlagSbStream);
+    telnet_setsblimit(ts, 256);
+    CHECK(sb_collect(ts, got, &got_len)==4);
+    CHECK(got_len==999 && !memcmp(got, want, 999));
+    telnet_free(ts);
+}
+
+/* a broken state stops the parse instead of spinning in telnet_continue() */
+static void test_error(void) {
+    struct telnet_event ev[4];
+    struct telnet_info *ts=telnet_create(0);
+    const char *text;
+    size_t len;
+    unsigned char cmd, opt;
+
+    telnet_begin(ts, 4, "ab\377\361");
+    ts->telnet_state=(enum telnet_state)(TelnetStateMax+1);
+    CHECK(!telnet_gettext(ts, &len, &text));
+    CHECK(ts->telnet_state==TelnetStateError);
+    CHECK(!telnet_continue(ts));
+    CHECK(!telnet_getcontrol(ts, &cmd, &opt, NULL, NULL));
+    CHECK(telnet_parse_batch(ts, ev, 4)==0);
+    CHECK(telnet_getstats(ts)->errors==1);
+    telnet_end(ts);
+
+    /* the next buffer finds it broken too */
+    telnet_begin(ts, 2, "cd");
+    CHECK(!telnet_continue(ts));
+    telnet_end(ts);
+    telnet_free(ts);
+}
+
+static void test_stats(void) {
+    /* 2 text runs with an IAC IAC, NOP, AYT, DO ECHO, WILL NAWS, an unknown
+     * code, a stray SE, NAWS split over two buffers, and TTYPE that is too
+     * long for the SB buffer.
+     */
+    static const char in1[]="ab\377\377cd\377\361\377\366\377\375\1\377\373\37\377\1\377\360\377\372\37\0";
+    static const char in2[]="\120\0\30\377\360\377\372\30\0xterm-";
+    static const char in3[]="256color\377\360";
+    struct telnet_event ev[32];
+    struct telnet_stats sum;
+    const struct telnet_stats *st;
+    struct telnet_info *ts=telnet_create(8);
+
+    telnet_begin(ts, sizeof(in1)-1, in1);
+    while(telnet_continue(ts)) telnet_parse_batch(ts, ev, 32);
+    telnet_end(ts);
+    telnet_begin(ts, sizeof(in2)-1, in2);
+    while(telnet_continue(ts)) telnet_parse_batch(ts, ev, 32);
+    telnet_end(ts);
+    telnet_begin(ts, sizeof(in3)-1, in3);
+    while(telnet_continue(ts)) telnet_parse_batch(ts, ev, 32);
+    telnet_end(ts);
+
+    st=telnet_getstats(ts);
+    CHECK(st->text_bytes==5);
+    CHECK(st->iac_escapes==1);
+    CHECK(st->commands[TELNET_STATS_CMD(NOP)]==1);
+    CHECK(st->commands[TELNET_STATS_CMD(AYT)]==1);
+    CHECK(st->commands[TELNET_STATS_CMD(DO)]==1);
+    CHECK(st->commands[TELNET_STATS_CMD(WILL)]==1);
+    CHECK(st->commands[TELNET_STATS_CMD(SE)]==1);
+    CHECK(st->commands[TELNET_STATS_CMD(SB)]==2);
+    CHECK(st->negotiations[TELNET_STATS_NEG(DO)]==1);
+    CHECK(st->negotiations[TELNET_STATS_NEG(WILL)]==1);
+    CHECK(st->negotiations[TELNET_STATS_NEG(DONT)]==0);
+    CHECK(st->options[TELOPT_ECHO]==1);
+    CHECK(st->options[TELOPT_NAWS]==1);
+    CHECK(st->options[TELOPT_TTYPE]==0);
+    CHECK(st->unknown==1);
+    CHECK(st->sb_frames==2);
+    CHECK(st->sb_bytes==5+8);
+    CHECK(st->sb_truncated==1);
+    CHECK(st->errors==0);
+
+    memset(&sum, 0, sizeof(sum));
+    telnet_stats_add(&sum, st);
+    telnet_stats_add(&sum, st);
+    CHECK(sum.text_bytes==10 && sum.negotiations[TELNET_STATS_NEG(WILL)]==2 && sum.options[TELOPT_NAWS]==2 && sum.sb_truncated==2);
+    telnet_free(ts);
+}
+
+/* the trace holds every buffer as it was given, before in place decoding.
+ * more buffers than fit one writev() batch still make one run of records.
+ */
+static void test_trace(void) {
+    char path[]="/tmp/test_telnetXXXXXX";
+    char inplace[]="a\377\377b";
+    struct iovec iov[2]={ { "x\377", 2 }, { "\361y", 2 } }, many[10];
+    struct telnet_trace_record rec;
+    struct telnet_trace *tr;
+    struct telnet_info *ts=telnet_create(0);
+    const char *text;
+    char buf[1024];
+    size_t len, pos;
+    int fd, i;
+
+    fd=mkstemp(path);
+    CHECK(fd>=0);
+    close(fd);
+    tr=telnet_trace_open(path);
+    CHECK(tr != NULL);
+    telnet_begin(ts, 3, "pre");
+    telnet_end(ts);
+    telnet_settrace(ts, tr, 7);
+    telnet_begin_inplace(ts, 4, inplace);
+    while(telnet_continue(ts)) telnet_gettext(ts, &len, &text);
+    telnet_end(ts);
+    telnet_beginv(ts, iov, 2);
+    telnet_end(ts);
+    for(i=0;i<10;i++) {
+        many[i].iov_base="0123456789"+i;
+        many[i].iov_len=1;
+    }
+    telnet_beginv(ts, many, 10);
+    telnet_end(ts);
+    telnet_settrace(ts, NULL, 0);
+    telnet_begin(ts, 4, "post");
+    telnet_end(ts);
+    telnet_trace_close(tr);
+
+    fd=open(path, O_RDONLY);
+    len=read(fd, buf, sizeof(buf));
+    close(fd);
+    unlink(path);
+    CHECK(len==8+14*sizeof(rec)+4+2+2+10);
+    CHECK(!memcmp(buf, TELNET_TRACE_MAGIC, 8));
+    pos=8;
+    memcpy(&rec, buf+pos, sizeof(rec));
+    CHECK(rec.conn==7 && rec.flags==TelnetTraceStart && rec.len==0 && rec.time_ns);
+    pos+=sizeof(rec);
+    memcpy(&rec, buf+pos, sizeof(rec));
+    CHECK(rec.conn==7 && rec.flags==0 && rec.len==4);
+    pos+=sizeof(rec);
+    CHECK(!memcmp(buf+pos, "a\377\377b", 4));
+    pos+=4;
+    memcpy(&rec, buf+pos, sizeof(rec));
+    CHECK(rec.flags==TelnetTraceMore && rec.len==2 && !memcmp(buf+pos+sizeof(rec), "x\377", 2));
+    pos+=sizeof(rec)+2;
+    memcpy(&rec, buf+pos, sizeof(rec));
+    CHECK(rec.flags==0 && rec.len==2 && !memcmp(buf+pos+sizeof(rec), "\361y", 2));
+    pos+=sizeof(rec)+2;
+    for(i=0;i<10;i++) {
+        memcpy(&rec, buf+pos, sizeof(rec));
+        CHECK(rec.conn==7 && rec.flags==(i<9 ? TelnetTraceMore : 0) && rec.len==1 && buf[pos+sizeof(rec)]=='0'+i);
+        pos+=sizeof(rec)+1;
+    }
+    telnet_free(ts);
+}
+
+static void test_stream(void) {
     const struct {
         int n;
         char *b;
@@ -80,7 +1310,8 @@ int main() {
                 }
                 if(ex && exlen>0) {
 #ifndef NDEBUG
-                        hexdump(exlen, ex);
+                    size_t i;
+                    for(i=0;i<exlen;i++) fprintf(stderr, " %02X", ex[i]);
 #endif
                 }
                 fprintf(stderr, "\n");
@@ -91,5 +1322,38 @@ int main() {
     }
     telnet_free(ts);
     fputc('\n', stdout);
+}
+
+int main() {
+    test_stream();
+    test_scan();
+    test_batch();
+    test_beginv();
+    test_inplace();
+    test_newline();
+    test_linebuf();
+    test_escape();
+#ifdef JDM_TELNET_MCCP
+    test_mccp();
+#endif
+    test_outq();
+    test_frame();
+#ifdef JDM_TELNET_MCCP
+    test_outq_mccp();
+    test_frame_mccp();
+    test_frame_discard();
+#endif
+    test_qmethod();
+    test_pool();
+    test_subneg();
+    test_sbdecode();
+    test_sbsize();
+    test_error();
+    test_stats();
+    test_trace();
+    if(failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,145 @@
+/************************** C++ FRONT END TEST CODE **************************/
+
+#include "jdm_telnet.hpp"
+
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+static int failures;
+
+#define CHECK(x) do { \
+        if(!(x)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+            failures++; \
+        } \
+    } while(0)
+
+/* writes every callback it gets into log */
+struct recorder : jdm::telnet_parser<recorder> {
+    std::string log;
+
+    void on_text(std::string_view text) {
+        log+="T:";
+        log+=text;
+        log+=' ';
+    }
+    void on_command(unsigned char command) {
+        log+="C:"+std::to_string(command)+' ';
+    }
+    void on_negotiate(unsigned char command, unsigned char option) {
+        log+="N:"+std::to_string(command)+','+std::to_string(option)+' ';
+    }
+    void on_subneg(unsigned char option, std::string_view payload, int chunk) {
+        log+="S:"+std::to_string(option)+','+std::to_string(payload.size())+','+std::to_string(chunk)+' ';
+    }
+    void on_naws(const telnet_naws &naws) {
+        log+="W:"+std::to_string(naws.width)+'x'+std::to_string(naws.height)+' ';
+    }
+    void on_ttype(std::string_view name) {
+        log+="Y:";
+        log+=name;
+        log+=' ';
+    }
+    void on_environ(int qual, telnet_sbiter it) {
+        telnet_environ var;
+
+        log+="E:"+std::to_string(qual);
+        while(telnet_environ_next(&it, &var)) {
+            log+=',';
+            log.append(var.name, var.name_len);
+        }
+        log+=' ';
+    }
+};
+
+/* NAWS is not decoded, but still goes to on_subneg() */
+struct raw_naws : jdm::telnet_parser<raw_naws> {
+    static constexpr jdm::telnet_subneg_map subneg_table=[] {
+        jdm::telnet_subneg_map t=jdm::telnet_subneg_table();
+        t[TELOPT_NAWS]=jdm::telnet_subneg::raw;
+        return t;
+    }();
+    std::string log;
+
+    void on_subneg(unsigned char option, std::string_view payload, int chunk) {
+        log+="S:"+std::to_string(option)+','+std::to_string(payload.size())+','+std::to_string(chunk)+' ';
+    }
+    void on_naws(const telnet_naws&) {
+        log+="W ";
+    }
+};
+
+/* only wants commands, everything else goes to the defaults */
+struct commands_only : jdm::telnet_parser<commands_only, 16> {
+    int count=0;
+
+    void on_command(unsigned char) {
+        count++;
+    }
+};
+
+static_assert(!std::is_copy_constructible_v<recorder>, "parsers are not copied");
+static_assert(std::is_nothrow_move_constructible_v<recorder>, "parsers move");
+
+static void test_dispatch() {
+    static const char in[]="hi\377\377\377\361\377\375\1"
+        "\377\372\37\0\120\0\30\377\360"
+        "\377\372\30\0xterm\377\360"
+        "\377\372\47\0\0USER\1me\377\360"
+        "\377\372\311ab\377\360";
+    recorder r;
+
+    CHECK(r.feed(in, sizeof(in)-1));
+    CHECK(r.log=="T:hi T:\377 C:241 N:253,1 W:80x24 Y:xterm E:0,USER S:201,3,3 ");
+}
+
+static void test_table() {
+    static const char in[]="\377\372\37\0\120\0\30\377\360";
+    raw_naws r;
+
+    CHECK(r.feed(std::string_view(in, sizeof(in)-1)));
+    CHECK(r.log=="S:31,5,3 ");
+}
+
+/* a frame split over two buffers is decoded once it is complete. pieces
+ * of a frame too long for the SB buffer are not decoded.
+ */
+static void test_pieces() {
+    static const char in[]="\377\372\30\0xterm-256color\377\360";
+    struct iovec iov[2]={ { (void*)in, 6 }, { (void*)(in+6), sizeof(in)-7 } };
+    recorder r;
+
+    CHECK(r.feed(iov, 2));
+    CHECK(r.log=="Y:xterm-256color ");
+
+    recorder small=std::move(r);
+    CHECK(r.get()==nullptr);
+    small.log.clear();
+    small.setflags(TelnetFlagSbStream);
+    CHECK(small.feed("ab\377\372\30\0", 6));
+    CHECK(small.feed(std::string(60, 'x')+"\377\360"));
+    CHECK(small.log.rfind("T:ab S:24,", 0)==0);
+    CHECK(small.log.find(",1 ")!=std::string::npos);
+    CHECK(small.log.find(",2 ")!=std::string::npos);
+}
+
+static void test_defaults() {
+    static const char in[]="text\377\366\377\373\1\377\372\37\0\1\0\1\377\360\377\361";
+    commands_only c;
+
+    CHECK(c.feed(in, sizeof(in)-1));
+    CHECK(c.count==2);
+}
+
+int main() {
+    test_dispatch();
+    test_table();
+    test_pieces();
+    test_defaults();
+    if(failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}